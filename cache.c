@@ -0,0 +1,382 @@
+/*
+ *  The Tor TCP DNS Daemon
+ *
+ *  Copyright (c) Collin R. Mulliner <collin(AT)mulliner.org>
+ *  Copyright (c) 2010, The Tor Project, Inc.
+ *
+ *  Answer cache: a bounded hash of the answers we got back through Tor,
+ *  keyed on the question, evicting the least recently used entry when full.
+ *  Expired answers are kept a while longer to be served stale when the
+ *  upstream can't answer in time, see RFC 8767. A shard can be saved to and
+ *  loaded from a snapshot file, so that a restart doesn't begin cold.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "ttdnsd.h"
+
+/* Every worker thread has a cache shard of its own, so there's no locking */
+static __thread struct cache_entry_t **buckets; /**< hash chains */
+static __thread unsigned int num_buckets; /**< always a power of two */
+static __thread unsigned int max_entries; /**< 0 disables the cache */
+static __thread unsigned int num_entries;
+static __thread unsigned int stale_window; /**< seconds expired entries are kept */
+static __thread struct cache_entry_t lru; /**< lru.next is the most recently used */
+
+static __thread unsigned long cache_hits;
+static __thread unsigned long cache_misses;
+static __thread unsigned long cache_evictions;
+
+/* Snapshot file layout: this header, then count records of a
+   snapshot_rec_t, the key and the answer each, packed, oldest used first.
+   Written and read on the same host, so in host byte order. */
+#define SNAPSHOT_MAGIC "ttdnsdC"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header_t {
+    char magic[8];
+    unsigned int version;
+    unsigned int count; /**< records */
+    unsigned long long bytes; /**< of the records, all after the header */
+    unsigned int checksum; /**< FNV-1a of the records */
+    unsigned int pad;
+};
+
+struct snapshot_rec_t {
+    long long stored, expire; /**< absolute, see cache_entry_t */
+    unsigned short kl, bl; /**< key and answer bytes that follow */
+};
+
+static void cache_lru_unlink(struct cache_entry_t *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void cache_lru_push(struct cache_entry_t *e)
+{
+    e->next = lru.next;
+    e->prev = &lru;
+    lru.next->prev = e;
+    lru.next = e;
+}
+
+static void cache_remove(struct cache_entry_t *e)
+{
+    struct cache_entry_t **pp = &buckets[e->hash & (num_buckets - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    cache_lru_unlink(e);
+    num_entries--;
+    free(e);
+}
+
+/* Returns 1 on success, 0 if the bucket array can't be allocated. A size of
+   0 leaves the cache disabled. Answers are kept for stale seconds after they
+   expired. */
+int cache_init(unsigned int size, unsigned int stale)
+{
+    max_entries = size;
+    stale_window = stale;
+    num_entries = 0;
+    lru.next = lru.prev = &lru;
+    if (size == 0)
+        return 1;
+
+    for (num_buckets = 16; num_buckets < size && num_buckets < (1U << 30); num_buckets <<= 1);
+    if (!(buckets = calloc(num_buckets, sizeof(buckets[0])))) {
+        max_entries = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the entry for k, live or stale, or NULL; entries past the stale
+   window are dropped on the way. */
+static struct cache_entry_t *cache_find(const struct dns_key_t *k, time_t now)
+{
+    struct cache_entry_t *e;
+    unsigned int h;
+
+    if (max_entries == 0)
+        return NULL;
+
+    h = dns_key_hash(k);
+    for (e = buckets[h & (num_buckets - 1)]; e != NULL; e = e->hnext) {
+        if (e->hash == h && e->key.kl == k->kl && memcmp(e->key.k, k->k, k->kl) == 0)
+            break;
+    }
+    if (e != NULL && e->expire + stale_window <= now) {
+        cache_remove(e);
+        return NULL;
+    }
+    return e;
+}
+
+/* Returns the live entry for k or NULL. Counts the lookup as a hit or miss. */
+struct cache_entry_t *cache_lookup(const struct dns_key_t *k, time_t now)
+{
+    struct cache_entry_t *e = cache_find(k, now);
+
+    if (e == NULL || e->expire <= now) {
+        cache_misses++;
+        return NULL;
+    }
+    cache_lru_unlink(e);
+    cache_lru_push(e);
+    cache_hits++;
+    e->hits++;
+    return e;
+}
+
+/* Returns the entry for k if it's live or expired less than the stale
+   window ago, NULL otherwise. Isn't counted as a hit or miss. */
+struct cache_entry_t *cache_lookup_stale(const struct dns_key_t *k, time_t now)
+{
+    struct cache_entry_t *e = cache_find(k, now);
+
+    if (e != NULL) {
+        cache_lru_unlink(e);
+        cache_lru_push(e);
+    }
+    return e;
+}
+
+/* Stores a copy of the answer m that came in at stored and expires at
+   expire as the most recently used entry, replacing any older answer for
+   the same key. */
+static void cache_insert(const struct dns_key_t *k, const unsigned char *m, int len,
+                         time_t stored, time_t expire)
+{
+    struct cache_entry_t *e;
+    unsigned int h;
+
+    h = dns_key_hash(k);
+    for (e = buckets[h & (num_buckets - 1)]; e != NULL; e = e->hnext) {
+        if (e->hash == h && e->key.kl == k->kl && memcmp(e->key.k, k->k, k->kl) == 0) {
+            cache_remove(e);
+            break;
+        }
+    }
+    if (num_entries >= max_entries) {
+        cache_remove(lru.prev);
+        cache_evictions++;
+    }
+
+    if (!(e = malloc(sizeof(*e) + len))) {
+        printf("out of memory caching answer\n");
+        return;
+    }
+    e->hash = h;
+    memcpy(&e->key, k, sizeof(e->key));
+    e->stored = stored;
+    e->expire = expire;
+    e->hits = 0;
+    e->bl = len;
+    memcpy(e->b, m, len);
+
+    e->hnext = buckets[h & (num_buckets - 1)];
+    buckets[h & (num_buckets - 1)] = e;
+    cache_lru_push(e);
+    num_entries++;
+}
+
+/* Stores a copy of the answer m for ttl seconds, replacing any older answer
+   for the same key. Does nothing for ttl 0 or a disabled cache. */
+void cache_store(const struct dns_key_t *k, const unsigned char *m, int len,
+                 unsigned int ttl, time_t now)
+{
+    if (max_entries == 0 || ttl == 0 || len <= 0)
+        return;
+    cache_insert(k, m, len, now, now + ttl);
+}
+
+static unsigned int snapshot_checksum(const unsigned char *p, unsigned long long len)
+{
+    unsigned int h = 2166136261U;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Serializes the entries of the shard that aren't past the stale window
+   into a snapshot of *len bytes in *out, which the caller frees; see
+   cache_write(). Returns the entries in it or -1 if out of memory. */
+int cache_dump(time_t now, unsigned char **out, size_t *len)
+{
+    struct snapshot_header_t hdr;
+    struct snapshot_rec_t rec;
+    struct cache_entry_t *e;
+    unsigned long long bytes = 0;
+    unsigned char *buf, *p;
+    size_t total;
+    unsigned int count = 0;
+
+    for (e = lru.prev; e != &lru; e = e->prev) {
+        if (e->expire + stale_window > now)
+            bytes += sizeof(rec) + e->key.kl + e->bl;
+    }
+    total = sizeof(hdr) + bytes;
+    if (!(buf = malloc(total))) {
+        printf("out of memory saving the cache\n");
+        return -1;
+    }
+
+    // oldest first, so that loading them in order rebuilds the LRU list
+    p = buf + sizeof(hdr);
+    for (e = lru.prev; e != &lru; e = e->prev) {
+        if (e->expire + stale_window <= now)
+            continue;
+        rec.stored = e->stored;
+        rec.expire = e->expire;
+        rec.kl = e->key.kl;
+        rec.bl = e->bl;
+        memcpy(p, &rec, sizeof(rec));
+        memcpy(p + sizeof(rec), e->key.k, e->key.kl);
+        memcpy(p + sizeof(rec) + e->key.kl, e->b, e->bl);
+        p += sizeof(rec) + e->key.kl + e->bl;
+        count++;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.count = count;
+    hdr.bytes = bytes;
+    hdr.checksum = snapshot_checksum(buf + sizeof(hdr), bytes);
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    *out = buf;
+    *len = total;
+    return count;
+}
+
+/* Writes the snapshot buf of len bytes to path.tmp, syncs it and renames
+   it over path. A crash on the way leaves the previous snapshot, and a
+   worker that has path open to load it keeps reading the old file. Touches
+   no cache state, so it may run in a thread of its own. Returns 0 on
+   success, -1 on failure. */
+int cache_write(const char *path, const unsigned char *buf, size_t len)
+{
+    char tmp[PATH_MAX];
+    ssize_t ret;
+    size_t done;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 00600)) < 0) {
+        printf("can't open %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    for (done = 0; done < len; done += ret) {
+        if ((ret = write(fd, buf + done, len - done)) < 0 && errno == EINTR)
+            ret = 0;
+        else if (ret <= 0)
+            goto fail;
+    }
+    if (fsync(fd) < 0)
+        goto fail;
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    if (rename(tmp, path) < 0) {
+        printf("can't rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+
+fail:
+    printf("writing the cache snapshot %s failed: %s\n", tmp, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/* Fills the shard from the snapshot file fd, leaving out the entries that
+   are past the stale window by now. Returns the entries loaded, 0 for an
+   empty file, or -1 if the file is corrupt or truncated; nothing is loaded
+   from it then. */
+int cache_load(int fd, time_t now)
+{
+    struct snapshot_header_t hdr;
+    struct snapshot_rec_t rec;
+    struct dns_key_t k;
+    struct stat st;
+    unsigned char *m;
+    unsigned long long off;
+    unsigned int i;
+    int loaded = 0;
+
+    if (max_entries == 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+        return 0;
+    if ((unsigned long long)st.st_size < sizeof(hdr))
+        return -1;
+    if ((m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror("mapping the cache snapshot");
+        return -1;
+    }
+    madvise(m, st.st_size, MADV_SEQUENTIAL);
+
+    memcpy(&hdr, m, sizeof(hdr));
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != SNAPSHOT_VERSION
+        || hdr.bytes != (unsigned long long)st.st_size - sizeof(hdr)
+        || hdr.checksum != snapshot_checksum(m + sizeof(hdr), hdr.bytes)) {
+        munmap(m, st.st_size);
+        return -1;
+    }
+
+    // the checksum passed, but the records are checked before anything goes in
+    off = sizeof(hdr);
+    for (i = 0; i < hdr.count; i++) {
+        if (off + sizeof(rec) > (unsigned long long)st.st_size)
+            break;
+        memcpy(&rec, m + off, sizeof(rec));
+        if (rec.kl == 0 || rec.kl > sizeof(k.k) || rec.bl == 0
+            || off + sizeof(rec) + rec.kl + rec.bl > (unsigned long long)st.st_size)
+            break;
+        off += sizeof(rec) + rec.kl + rec.bl;
+    }
+    if (i < hdr.count || off != (unsigned long long)st.st_size) {
+        munmap(m, st.st_size);
+        return -1;
+    }
+
+    off = sizeof(hdr);
+    for (i = 0; i < hdr.count; i++) {
+        memcpy(&rec, m + off, sizeof(rec));
+        if (rec.expire + stale_window > now) {
+            memcpy(k.k, m + off + sizeof(rec), rec.kl);
+            k.kl = rec.kl;
+            cache_insert(&k, m + off + sizeof(rec) + rec.kl, rec.bl, rec.stored, rec.expire);
+            loaded++;
+        }
+        off += sizeof(rec) + rec.kl + rec.bl;
+    }
+    munmap(m, st.st_size);
+    return loaded;
+}
+
+void cache_stats(void)
+{
+    printf("cache: %u/%u entries, %lu hits, %lu misses, %lu evictions\n",
+           num_entries, max_entries, cache_hits, cache_misses, cache_evictions);
+}
@@ -0,0 +1,396 @@
+/*
+ *  The Tor TCP DNS Daemon
+ *
+ *  Copyright (c) Collin R. Mulliner <collin(AT)mulliner.org>
+ *  Copyright (c) 2010, The Tor Project, Inc.
+ *
+ *  DNS message helpers: just enough parsing to key, age and sanity check
+ *  the messages we shuffle between UDP clients and the TCP peers.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "ttdnsd.h"
+
+static unsigned short dns_get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned int dns_get32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void dns_put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* Returns the offset just past the (possibly compressed) name at off or -1
+   if the name runs off the end of the message. */
+int dns_skip_name(const unsigned char *m, int len, int off)
+{
+    while (off < len) {
+        if (m[off] == 0)
+            return off + 1;
+        if ((m[off] & 0xc0) == 0xc0)
+            return (off + 2 <= len) ? off + 2 : -1;
+        if (m[off] & 0xc0)
+            return -1;
+        off += m[off] + 1;
+    }
+    return -1;
+}
+
+/* Walks every resource record after the question section and calls fn with
+   the section (1=answer, 2=authority, 3=additional) and the offset of the
+   record's fixed part (type, class, ttl, rdlength). Returns the number of
+   records walked or -1 on a malformed message. */
+static int dns_walk_rrs(unsigned char *m, int len,
+                        void (*fn)(unsigned char *m, int len, int section, int rr, void *arg),
+                        void *arg)
+{
+    int off = DNS_HEADER_SIZE;
+    int count[3];
+    int qd;
+    int i, s;
+    int n = 0;
+
+    if (len < DNS_HEADER_SIZE)
+        return -1;
+    qd = dns_get16(m + 4);
+    count[0] = dns_get16(m + 6);
+    count[1] = dns_get16(m + 8);
+    count[2] = dns_get16(m + 10);
+
+    for (i = 0; i < qd; i++) {
+        if ((off = dns_skip_name(m, len, off)) < 0 || off + 4 > len)
+            return -1;
+        off += 4;
+    }
+    for (s = 0; s < 3; s++) {
+        for (i = 0; i < count[s]; i++) {
+            if ((off = dns_skip_name(m, len, off)) < 0 || off + 10 > len)
+                return -1;
+            if (off + 10 + dns_get16(m + off + 8) > len)
+                return -1;
+            if (fn)
+                fn(m, len, s + 1, off, arg);
+            off += 10 + dns_get16(m + off + 8);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Builds the lookup key of the single question in m: the lower-cased wire
+   name followed by qtype, qclass and the EDNS DO bit. Returns the offset
+   just past the question section or -1 if m isn't a single question
+   message we know how to key. */
+int dns_question_key(const unsigned char *m, int len, struct dns_key_t *k)
+{
+    int off = DNS_HEADER_SIZE;
+    int kl = 0;
+    int qend;
+    int i, n;
+
+    if (len < DNS_HEADER_SIZE || dns_get16(m + 4) != 1)
+        return -1;
+
+    while (off < len && m[off] != 0) {
+        if (m[off] & 0xc0)
+            return -1;
+        n = m[off];
+        if (off + n + 1 > len || kl + n + 1 > DNS_MAX_NAME)
+            return -1;
+        k->k[kl++] = n;
+        for (i = 1; i <= n; i++) {
+            unsigned char c = m[off + i];
+            k->k[kl++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+        off += n + 1;
+    }
+    if (off + 5 > len)
+        return -1;
+    k->k[kl++] = 0;
+    off++;
+    memcpy(k->k + kl, m + off, 4);
+    kl += 4;
+    off += 4;
+    qend = off;
+
+    // an OPT pseudo-RR in the additional section carries the DO bit
+    k->k[kl] = 0;
+    if (dns_get16(m + 6) == 0 && dns_get16(m + 8) == 0 && dns_get16(m + 10) == 1
+        && off + 11 <= len && m[off] == 0 && dns_get16(m + off + 1) == DNS_TYPE_OPT)
+        k->k[kl] = (m[off + 7] & 0x80) ? 1 : 0;
+    kl++;
+
+    k->kl = kl;
+    return qend;
+}
+
+/* FNV-1a; keys are short and already lower-cased */
+unsigned int dns_key_hash(const struct dns_key_t *k)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 0; i < k->kl; i++) {
+        h ^= k->k[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Builds a response with rcode to the query q in out, which must have room
+   for len bytes: q's header and question, no records. Returns its length or
+   -1 if q is too short to be answered. */
+int dns_error_reply(const unsigned char *q, int len, int rcode, unsigned char *out)
+{
+    int qend = -1;
+
+    if (len < DNS_HEADER_SIZE)
+        return -1;
+    if (dns_get16(q + 4) == 1)
+        qend = dns_skip_name(q, len, DNS_HEADER_SIZE);
+    qend = (qend >= 0 && qend + 4 <= len) ? qend + 4 : DNS_HEADER_SIZE;
+
+    memcpy(out, q, qend);
+    out[2] = 0x80 | (q[2] & 0x79); // QR, keep opcode and RD
+    out[3] = 0x80 | (rcode & 0x0f); // RA
+    memset(out + 4, 0, DNS_HEADER_SIZE - 4);
+    out[5] = qend > DNS_HEADER_SIZE;
+    return qend;
+}
+
+/* Returns the largest answer the sender of the query q of len bytes takes
+   over UDP: the payload size its OPT pseudo-RR offers, or 512 bytes if it
+   has none (RFC 6891). */
+int dns_udp_size(const unsigned char *q, int len)
+{
+    int off;
+    int size;
+
+    if (len < DNS_HEADER_SIZE || dns_get16(q + 4) != 1 || dns_get16(q + 6) != 0
+        || dns_get16(q + 8) != 0 || dns_get16(q + 10) != 1)
+        return DNS_UDP_SIZE;
+    if ((off = dns_skip_name(q, len, DNS_HEADER_SIZE)) < 0 || off + 4 + 11 > len)
+        return DNS_UDP_SIZE;
+    off += 4;
+    if (q[off] != 0 || dns_get16(q + off + 1) != DNS_TYPE_OPT)
+        return DNS_UDP_SIZE;
+    size = dns_get16(q + off + 3);
+    return size > DNS_UDP_SIZE ? size : DNS_UDP_SIZE;
+}
+
+/* Cuts the answer m of len bytes down to its header and question with the
+   TC bit set, which tells the client to ask again over TCP. Returns the new
+   length. */
+int dns_truncate(unsigned char *m, int len)
+{
+    int qend = -1;
+
+    if (len < DNS_HEADER_SIZE)
+        return len;
+    if (dns_get16(m + 4) == 1)
+        qend = dns_skip_name(m, len, DNS_HEADER_SIZE);
+    qend = (qend >= 0 && qend + 4 <= len) ? qend + 4 : DNS_HEADER_SIZE;
+    m[2] |= 0x02;
+    memset(m + 6, 0, DNS_HEADER_SIZE - 6);
+    if (qend == DNS_HEADER_SIZE)
+        m[4] = m[5] = 0;
+    return qend;
+}
+
+/* Tells how the question keyed k can be put to Tor with its SOCKS RESOLVE
+   extension: DNS_TYPE_A with the name, dotted, in name (DNS_MAX_NAME + 1
+   bytes), or DNS_TYPE_PTR with the address of an in-addr.arpa name in addr.
+   Returns 0 for anything else, including questions with the DO bit, since
+   Tor has no signatures to give. */
+int dns_resolve_question(const struct dns_key_t *k, char *name, struct in_addr *addr)
+{
+    unsigned int o[4];
+    int type, off = 0, nl = 0;
+    int i, n, end;
+
+    if (k->kl < 6 || k->k[k->kl - 1] != 0 || dns_get16(k->k + k->kl - 3) != DNS_CLASS_IN)
+        return 0;
+    type = dns_get16(k->k + k->kl - 5);
+    if (type != DNS_TYPE_A && type != DNS_TYPE_PTR)
+        return 0;
+
+    // the key's name is lower-cased already; only plain host names go
+    while ((n = k->k[off]) != 0) {
+        for (i = 1; i <= n; i++) {
+            unsigned char c = k->k[off + i];
+            if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_'))
+                return 0;
+        }
+        if (nl > 0)
+            name[nl++] = '.';
+        memcpy(name + nl, k->k + off + 1, n);
+        nl += n;
+        off += n + 1;
+    }
+    name[nl] = 0;
+    if (nl == 0)
+        return 0;
+    if (type == DNS_TYPE_A)
+        return type;
+
+    end = -1;
+    if (sscanf(name, "%3u.%3u.%3u.%3u.in-addr.arpa%n", &o[3], &o[2], &o[1], &o[0], &end) != 4
+        || end != nl || o[0] > 255 || o[1] > 255 || o[2] > 255 || o[3] > 255)
+        return 0;
+    addr->s_addr = htonl((o[0] << 24) | (o[1] << 16) | (o[2] << 8) | o[3]);
+    return type;
+}
+
+/* Encodes the dotted name of len bytes in wire format into out, which needs
+   room for len + 2 bytes. Returns the encoded length or -1 if it isn't a
+   valid name. */
+int dns_name_encode(const char *name, int len, unsigned char *out)
+{
+    int start = 0, ol = 0;
+    int i;
+
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len > DNS_MAX_NAME - 2)
+        return -1;
+    for (i = 0; i < len; i++) {
+        if (name[i] != '.' && i + 1 < len)
+            continue;
+        if (name[i] != '.')
+            i++;
+        if (i - start == 0 || i - start > 63)
+            return -1;
+        out[ol++] = i - start;
+        memcpy(out + ol, name + start, i - start);
+        ol += i - start;
+        start = i + 1;
+    }
+    out[ol++] = 0;
+    return ol;
+}
+
+/* Builds a response to the query q, whose question section ends at qend,
+   in out: one answer record for the question's name with type, ttl and the
+   rdlen bytes of rdata at rd. out needs room for qend + 12 + rdlen bytes.
+   Returns its length. */
+int dns_answer_reply(const unsigned char *q, int qend, int type, unsigned int ttl,
+                     const unsigned char *rd, int rdlen, unsigned char *out)
+{
+    unsigned char *a = out + qend;
+
+    memcpy(out, q, qend);
+    out[2] = 0x80 | (q[2] & 0x79); // QR, keep opcode and RD
+    out[3] = 0x80 | DNS_RCODE_NOERROR; // RA
+    memset(out + 4, 0, DNS_HEADER_SIZE - 4);
+    out[5] = 1;
+    out[7] = 1;
+
+    a[0] = 0xc0; // compressed, points at the question's name
+    a[1] = DNS_HEADER_SIZE;
+    a[2] = type >> 8;
+    a[3] = type;
+    a[4] = 0;
+    a[5] = DNS_CLASS_IN;
+    dns_put32(a + 6, ttl);
+    a[10] = rdlen >> 8;
+    a[11] = rdlen;
+    memcpy(a + 12, rd, rdlen);
+    return qend + 12 + rdlen;
+}
+
+struct dns_ttl_walk {
+    unsigned int ttl;
+    int seen;
+    int rcode;
+    int answers;
+};
+
+static void dns_min_ttl_rr(unsigned char *m, int len, int section, int rr, void *arg)
+{
+    struct dns_ttl_walk *w = arg;
+    unsigned short type = dns_get16(m + rr);
+    unsigned int ttl = dns_get32(m + rr + 4);
+
+    if (type == DNS_TYPE_OPT)
+        return;
+    /* Negative answers are cached for min(SOA TTL, SOA MINIMUM), see
+       RFC 2308 section 5; the MINIMUM field is the last 4 bytes of rdata. */
+    if (section == 2 && type == DNS_TYPE_SOA && w->answers == 0) {
+        int end = rr + 10 + dns_get16(m + rr + 8);
+        if (end - 4 >= rr + 10 && end <= len && dns_get32(m + end - 4) < ttl)
+            ttl = dns_get32(m + end - 4);
+    }
+    if (!w->seen || ttl < w->ttl)
+        w->ttl = ttl;
+    w->seen = 1;
+}
+
+/* Returns how many seconds the response m may be cached for: the minimum
+   TTL of its records, or 0 if it shouldn't be cached at all (truncated,
+   errors other than NXDOMAIN, negative answers without SOA). */
+unsigned int dns_min_ttl(unsigned char *m, int len)
+{
+    struct dns_ttl_walk w;
+
+    if (len < DNS_HEADER_SIZE)
+        return 0;
+    // truncated answers would be retried over TCP by the client anyway
+    if (m[2] & 0x02)
+        return 0;
+    memset(&w, 0, sizeof(w));
+    w.rcode = m[3] & 0x0f;
+    w.answers = dns_get16(m + 6);
+    if (w.rcode != DNS_RCODE_NOERROR && w.rcode != DNS_RCODE_NXDOMAIN)
+        return 0;
+    if (dns_walk_rrs(m, len, dns_min_ttl_rr, &w) < 0 || !w.seen)
+        return 0;
+    return w.ttl;
+}
+
+static void dns_age_rr(unsigned char *m, int len, int section, int rr, void *arg)
+{
+    unsigned int age = *(unsigned int*)arg;
+    unsigned int ttl = dns_get32(m + rr + 4);
+
+    (void)len;
+    (void)section;
+    if (dns_get16(m + rr) == DNS_TYPE_OPT)
+        return;
+    dns_put32(m + rr + 4, ttl > age ? ttl - age : 0);
+}
+
+/* Subtracts age seconds from every TTL in m, so that cached answers count
+   down instead of handing out the original TTL again and again. */
+void dns_age_ttls(unsigned char *m, int len, unsigned int age)
+{
+    if (age > 0)
+        dns_walk_rrs(m, len, dns_age_rr, &age);
+}
+
+static void dns_set_ttl_rr(unsigned char *m, int len, int section, int rr, void *arg)
+{
+    (void)len;
+    (void)section;
+    if (dns_get16(m + rr) != DNS_TYPE_OPT)
+        dns_put32(m + rr + 4, *(unsigned int*)arg);
+}
+
+/* Sets every TTL in m to ttl, for stale answers that have none left. */
+void dns_set_ttls(unsigned char *m, int len, unsigned int ttl)
+{
+    dns_walk_rrs(m, len, dns_set_ttl_rr, &ttl);
+}
@@ -0,0 +1,305 @@
+#!/usr/bin/env python3
+'''
+ fake-socks.py: a stand-in for Tor's SOCKS port, to run ttdnsd against
+ without Tor or a network, see the fake-socks-test target of the Makefile.
+
+ It speaks SOCKS 5 with or without RFC 1929 username/password
+ authentication (any credentials do) and takes three commands:
+
+  CONNECT (0x01)      to any address: the stream becomes a DNS over TCP
+                      responder, answering queries in the order their
+                      answers are ready
+  RESOLVE (0xF0)      answers an IPv4 address for the name
+  RESOLVE_PTR (0xF1)  answers a name for the address
+
+ The answers are made up, the same for the same question:
+
+  - names under .invalid get NXDOMAIN from the responder and a "host
+    unreachable" reply to RESOLVE
+  - names under .v6 get an IPv6 address from RESOLVE, which ttdnsd can't
+    use for an A question
+  - names starting with "slow" are answered --slow seconds late by the
+    responder, to watch retries and hedging
+  - PTR questions for x.x.x.255 get a "host unreachable" reply to
+    RESOLVE_PTR
+  - A questions get an address in 192.0.2.0/24, other types no records
+
+ With --query it is a small DNS client instead, for checking the answers
+ ttdnsd gives: it prints them and exits 1 if the rcode isn't the one
+ expected or there's no answer within 5 seconds.
+
+ usage: fake-socks.py [--listen ip:port] [--slow s]
+        fake-socks.py --query ip:port [--tcp] [--rcode NAME] name [type]
+'''
+
+import argparse
+import hashlib
+import random
+import socket
+import socketserver
+import struct
+import sys
+import threading
+
+TYPES = {'A': 1, 'NS': 2, 'CNAME': 5, 'SOA': 6, 'PTR': 12, 'MX': 15,
+         'TXT': 16, 'AAAA': 28, 'SRV': 33}
+RCODES = {'NOERROR': 0, 'FORMERR': 1, 'SERVFAIL': 2, 'NXDOMAIN': 3,
+          'NOTIMP': 4, 'REFUSED': 5}
+TTL = 300
+
+
+def log(*args):
+    print('fake-socks:', *args, file=sys.stderr, flush=True)
+
+
+def fake_addr(name):
+    '''The made-up IPv4 address of name, in 192.0.2.0/24.'''
+    return bytes([192, 0, 2, hashlib.sha1(name.lower().encode()).digest()[0] | 1])
+
+
+def encode_name(name):
+    out = b''
+    for label in name.rstrip('.').split('.'):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def decode_name(m, off):
+    '''Returns the dotted name at off and the offset past it; questions
+    aren't compressed.'''
+    labels = []
+    while m[off] != 0:
+        labels.append(m[off + 1:off + 1 + m[off]].decode('ascii', 'replace'))
+        off += 1 + m[off]
+    return '.'.join(labels), off + 1
+
+
+def dns_answer(q):
+    '''Returns the answer to the query q and the seconds to hold it back,
+    or None for a query too short to have an id; ttdnsd forwards what
+    clients send as it is.'''
+    if len(q) < 2:
+        log('DNS query of %d bytes dropped' % len(q))
+        return None, 0
+    qid, = struct.unpack('>H', q[:2])
+    flags = q[2] << 8 if len(q) > 2 else 0
+    formerr = struct.pack('>HHHHHH', qid, 0x8000 | (flags & 0x0100) | 1, 0, 0, 0, 0)
+    try:
+        qdcount, = struct.unpack('>H', q[4:6])
+        if qdcount != 1:
+            raise ValueError
+        name, off = decode_name(q, 12)
+        qtype, qclass = struct.unpack('>HH', q[off:off + 4])
+    except (IndexError, ValueError, struct.error):
+        log('DNS query of %d bytes -> FORMERR' % len(q))
+        return formerr, 0
+    question = q[12:off + 4]
+    lname = name.lower()
+    rcode, answers = 0, b''
+    if lname.endswith('.invalid') or lname == 'invalid':
+        rcode = 3
+    elif qtype == TYPES['A'] and qclass == 1:
+        answers = b'\xc0\x0c' + struct.pack('>HHIH', 1, 1, TTL, 4) + fake_addr(lname)
+    # RD copied, RA set, never AD
+    hdr = struct.pack('>HHHHHH', qid, 0x8080 | (flags & 0x0100) | rcode, 1,
+                      1 if answers else 0, 0, 0)
+    delay = ARGS.slow if lname.startswith('slow') else 0
+    log('DNS %s type %d -> rcode %d%s' % (name, qtype, rcode,
+                                          ', %g s late' % delay if delay else ''))
+    return hdr + question + answers, delay
+
+
+class Socks(socketserver.BaseRequestHandler):
+    def recv(self, n):
+        b = b''
+        while len(b) < n:
+            c = self.request.recv(n - len(b))
+            if not c:
+                raise EOFError
+            b += c
+        return b
+
+    def reply(self, code, atyp=1, addr=b'\0\0\0\0'):
+        if atyp == 3:
+            addr = bytes([len(addr)]) + addr
+        self.request.sendall(bytes([5, code, 0, atyp]) + addr + b'\0\0')
+
+    def handle(self):
+        try:
+            self.socks()
+        except (EOFError, ConnectionError):
+            pass
+
+    def socks(self):
+        ver, n = self.recv(2)
+        methods = self.recv(n)
+        if ver != 5:
+            return
+        if 2 in methods:
+            self.request.sendall(b'\x05\x02')
+            ver, ul = self.recv(2)
+            user = self.recv(ul)
+            pl, = self.recv(1)
+            self.recv(pl)
+            log('user', user.decode('ascii', 'replace'))
+            self.request.sendall(b'\x01\x00')
+        elif 0 in methods:
+            self.request.sendall(b'\x05\x00')
+        else:
+            self.request.sendall(b'\x05\xff')
+            return
+
+        ver, cmd, _, atyp = self.recv(4)
+        if atyp == 1:
+            addr = self.recv(4)
+        elif atyp == 3:
+            addr = self.recv(self.recv(1)[0])
+        elif atyp == 4:
+            addr = self.recv(16)
+        else:
+            self.reply(8)
+            return
+        self.recv(2)
+
+        if cmd == 0x01:
+            log('CONNECT', socket.inet_ntoa(addr) if atyp == 1 else addr)
+            self.reply(0)
+            self.dns()
+        elif cmd == 0xf0:
+            name = addr.decode('ascii', 'replace').lower()
+            if name.endswith('.invalid'):
+                log('RESOLVE', name, '-> host unreachable')
+                self.reply(4)
+            elif name.endswith('.v6'):
+                log('RESOLVE', name, '-> IPv6')
+                self.reply(0, 4, b'\x20\x01\x0d\xb8' + b'\0' * 11 + b'\1')
+            else:
+                log('RESOLVE', name, '->', socket.inet_ntoa(fake_addr(name)))
+                self.reply(0, 1, fake_addr(name))
+        elif cmd == 0xf1 and atyp == 1:
+            if addr[3] == 255:
+                log('RESOLVE_PTR', socket.inet_ntoa(addr), '-> host unreachable')
+                self.reply(4)
+            else:
+                name = 'host-%d-%d-%d-%d.example' % tuple(addr)
+                log('RESOLVE_PTR', socket.inet_ntoa(addr), '->', name)
+                self.reply(0, 3, name.encode())
+        else:
+            log('command 0x%02x not supported' % cmd)
+            self.reply(7)
+
+    def dns(self):
+        lock = threading.Lock()
+
+        def send(m):
+            with lock:
+                try:
+                    self.request.sendall(struct.pack('>H', len(m)) + m)
+                except OSError:
+                    pass
+
+        while True:
+            l, = struct.unpack('>H', self.recv(2))
+            m, delay = dns_answer(self.recv(l))
+            if m is None:
+                continue
+            if delay:
+                threading.Timer(delay, send, (m,)).start()
+            else:
+                send(m)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def addr_port(s):
+    host, port = s.rsplit(':', 1)
+    return host, int(port)
+
+
+def query(args):
+    qtype = TYPES.get(args.type.upper())
+    if qtype is None:
+        sys.exit('unknown type ' + args.type)
+    qid = random.randrange(65536)
+    q = struct.pack('>HHHHHH', qid, 0x0100, 1, 0, 0, 0) + encode_name(args.name) \
+        + struct.pack('>HH', qtype, 1)
+    try:
+        if args.tcp:
+            s = socket.create_connection(addr_port(args.query), timeout=5)
+            s.sendall(struct.pack('>H', len(q)) + q)
+            b = b''
+            while len(b) < 2 or len(b) < 2 + struct.unpack('>H', b[:2])[0]:
+                c = s.recv(65537)
+                if not c:
+                    break
+                b += c
+            m = b[2:]
+        else:
+            s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            s.settimeout(5)
+            s.sendto(q, addr_port(args.query))
+            m = s.recv(65535)
+    except (OSError, struct.error) as e:
+        print('%s %s: no answer (%s)' % (args.name, args.type, e))
+        return 1
+    if len(m) < 12 or struct.unpack('>H', m[:2])[0] != qid:
+        print('%s %s: bad answer' % (args.name, args.type))
+        return 1
+
+    flags, qd, an = struct.unpack('>HHH', m[2:8])
+    rcode = flags & 0xf
+    rname = [k for k, v in RCODES.items() if v == rcode]
+    out = '%s %s: %s' % (args.name, args.type, rname[0] if rname else rcode)
+    off = 12
+    for _ in range(qd):
+        off = decode_name(m, off)[1] + 4
+    for _ in range(an):
+        # the answers ttdnsd builds or forwards point back at the question
+        off = off + 2 if m[off] & 0xc0 else decode_name(m, off)[1]
+        t, _, ttl, rdl = struct.unpack('>HHIH', m[off:off + 10])
+        rd = m[off + 10:off + 10 + rdl]
+        if t == 1:
+            out += ' %s' % socket.inet_ntoa(rd)
+        elif t == 12:
+            out += ' %s' % decode_name(rd, 0)[0]
+        else:
+            out += ' type %d' % t
+        out += ' ttl %d' % ttl
+        off += 10 + rdl
+    print(out)
+    return 0 if rcode == RCODES[args.rcode.upper()] else 1
+
+
+def main():
+    global ARGS
+    p = argparse.ArgumentParser(description='Fake SOCKS 5 proxy for ttdnsd tests.')
+    p.add_argument('--listen', default='127.0.0.1:9150', help='address to listen on')
+    p.add_argument('--slow', type=float, default=3, help='seconds "slow" names take')
+    p.add_argument('--query', metavar='IP:PORT', help='ask a DNS server instead')
+    p.add_argument('--tcp', action='store_true', help='query over TCP')
+    p.add_argument('--rcode', default='NOERROR', help='rcode the query expects')
+    p.add_argument('name', nargs='?')
+    p.add_argument('type', nargs='?', default='A')
+    ARGS = p.parse_args()
+
+    if ARGS.query:
+        if not ARGS.name:
+            p.error('--query needs a name')
+        sys.exit(query(ARGS))
+
+    server = Server(addr_port(ARGS.listen), Socks)
+    log('listening on %s' % ARGS.listen)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+ARGS = None
+
+if __name__ == '__main__':
+    main()
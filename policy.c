@@ -0,0 +1,391 @@
+/*
+ *  The Tor TCP DNS Daemon
+ *
+ *  Copyright (c) Collin R. Mulliner <collin(AT)mulliner.org>
+ *  Copyright (c) 2010, The Tor Project, Inc.
+ *
+ *  Policy stage: hosts style overrides, local zones and domain blocklists,
+ *  answered right away instead of going through Tor. The lists are compiled
+ *  into a hash set of wire format names in one arena; a question is looked
+ *  up once per label of its name, longest suffix first. SIGHUP compiles
+ *  them again in a thread of their own and the workers pick up the new set
+ *  on their next loop.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ttdnsd.h"
+
+#define POLICY_HOST 0x01 /**< the name has an address of its own */
+#define POLICY_ZONE 0x02 /**< names under it are answered locally */
+#define POLICY_BLOCK 0x04 /**< it and the names under it are blocked */
+
+/* A name in the arena: flags, the address of a POLICY_HOST, the length of
+   the name and the lower-cased wire format name itself. */
+struct policy_name_t {
+    unsigned char flags;
+    unsigned char len;
+    unsigned char addr[4]; /**< network byte order */
+    unsigned char name[];
+};
+
+struct policy_slot_t {
+    unsigned int hash;
+    unsigned int off; /**< of the name in the arena, 0 for an empty slot */
+};
+
+struct policy_t {
+    unsigned char *arena; /**< policy_name_t records, offset 0 unused */
+    unsigned int used, size; /**< bytes of the arena */
+    struct policy_slot_t *slots; /**< open addressing, linear probing */
+    unsigned int num_slots; /**< always a power of two */
+    unsigned int names;
+    unsigned int hosts, zones, blocked; /**< lines taken from each file */
+};
+
+static const char *hosts_file, *zones_file, *block_file; /**< NULL if not set */
+static struct policy_t *policy_current; /**< swapped by the reload thread */
+static struct policy_t *policy_used[MAX_WORKERS]; /**< what each worker looks at */
+static __thread struct policy_t *policy; /**< this worker's, see policy_refresh() */
+
+static unsigned int policy_hash(const unsigned char *name, int len)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= name[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static struct policy_name_t *policy_find(const struct policy_t *p, const unsigned char *name,
+                                         int len, unsigned int h)
+{
+    unsigned int i;
+
+    for (i = h & (p->num_slots - 1); p->slots[i].off != 0; i = (i + 1) & (p->num_slots - 1)) {
+        struct policy_name_t *n = (struct policy_name_t*)(p->arena + p->slots[i].off);
+
+        if (p->slots[i].hash == h && n->len == len && memcmp(n->name, name, len) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+/* Doubles the slots once they're half full. Returns 0 if out of memory. */
+static int policy_grow(struct policy_t *p)
+{
+    struct policy_slot_t *old = p->slots;
+    unsigned int num = p->num_slots;
+    unsigned int i, j;
+
+    if (!(p->slots = calloc(num * 2, sizeof(p->slots[0])))) {
+        p->slots = old;
+        return 0;
+    }
+    p->num_slots = num * 2;
+    for (i = 0; i < num; i++) {
+        if (old[i].off == 0)
+            continue;
+        for (j = old[i].hash & (p->num_slots - 1); p->slots[j].off != 0; j = (j + 1) & (p->num_slots - 1));
+        p->slots[j] = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+/* Adds the dotted name with flags, merging them into an entry the name
+   has already. Returns 0 if out of memory, 1 otherwise; names that aren't
+   valid are left out. */
+static int policy_add(struct policy_t *p, const char *dotted, int flags, const unsigned char *addr)
+{
+    char lower[DNS_MAX_NAME + 1];
+    unsigned char name[DNS_MAX_NAME + 2];
+    struct policy_name_t *n;
+    unsigned int h, i;
+    int dl, len;
+
+    // blocklists like to say *.example.com for example.com and below
+    if (strncmp(dotted, "*.", 2) == 0)
+        dotted += 2;
+    for (dl = 0; dotted[dl] != 0 && dl < DNS_MAX_NAME; dl++)
+        lower[dl] = tolower((unsigned char)dotted[dl]);
+    lower[dl] = 0;
+    if ((len = dns_name_encode(lower, dl, name)) <= 1)
+        return 1;
+
+    h = policy_hash(name, len);
+    if ((n = policy_find(p, name, len, h)) == NULL) {
+        if (p->names * 2 >= p->num_slots && !policy_grow(p))
+            return 0;
+        if (p->used + sizeof(*n) + len > p->size) {
+            unsigned char *a = realloc(p->arena, p->size * 2);
+
+            if (a == NULL)
+                return 0;
+            p->arena = a;
+            p->size *= 2;
+        }
+        n = (struct policy_name_t*)(p->arena + p->used);
+        memset(n, 0, sizeof(*n));
+        n->len = len;
+        memcpy(n->name, name, len);
+        for (i = h & (p->num_slots - 1); p->slots[i].off != 0; i = (i + 1) & (p->num_slots - 1));
+        p->slots[i].hash = h;
+        p->slots[i].off = p->used;
+        p->used += sizeof(*n) + len;
+        p->names++;
+    }
+    n->flags |= flags;
+    if (addr != NULL)
+        memcpy(n->addr, addr, 4);
+    return 1;
+}
+
+static void policy_free(struct policy_t *p)
+{
+    if (p == NULL)
+        return;
+    free(p->arena);
+    free(p->slots);
+    free(p);
+}
+
+/* Names that hosts-format blocklists carry over from /etc/hosts; blocking
+   them would break localhost, and 0.0.0.0 isn't a name at all. */
+static const char *policy_not_blocked[] = {
+    "localhost", "localhost.localdomain", "local", "broadcasthost",
+    "ip6-localhost", "ip6-loopback", "ip6-localnet", "ip6-mcastprefix",
+    "ip6-allnodes", "ip6-allrouters", "ip6-allhosts", NULL
+};
+
+/* Tells if tok, a name on a blocklist line, is one of the above or an
+   address rather than a name. */
+static int policy_well_known(const char *tok)
+{
+    struct in_addr addr;
+    int i;
+
+    if (inet_pton(AF_INET, tok, &addr) == 1)
+        return 1;
+    for (i = 0; policy_not_blocked[i] != NULL; i++) {
+        if (strcasecmp(tok, policy_not_blocked[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Reads the names of file into p with flags. Hosts files have an IPv4
+   address and its names on a line, the other files a name per line or,
+   as many blocklists come, an address and names as well. Comments start
+   with #. Blocklists leave out the names of policy_well_known(). Returns
+   the lines taken or -1 if the file can't be read. */
+static int policy_read(struct policy_t *p, const char *file, int flags)
+{
+    char line[MAX_LINE_SIZE];
+    char *tok, *save;
+    struct in_addr addr;
+    FILE *fp;
+    int lines = 0;
+    int ok = 1;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        printf("can't open policy file %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+        if ((tok = strchr(line, '#')) != NULL)
+            *tok = 0;
+        if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (inet_pton(AF_INET, tok, &addr) == 1) {
+            tok = strtok_r(NULL, " \t\r\n", &save);
+        } else if (flags == POLICY_HOST || strchr(tok, ':') != NULL) {
+            // an IPv6 line, or no address at all
+            continue;
+        }
+        for (; tok != NULL && ok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (flags == POLICY_BLOCK && policy_well_known(tok))
+                continue;
+            ok = policy_add(p, tok, flags, flags == POLICY_HOST ? (unsigned char*)&addr : NULL);
+        }
+        lines++;
+    }
+    fclose(fp);
+    if (!ok) {
+        printf("out of memory reading policy file %s\n", file);
+        return -1;
+    }
+    return lines;
+}
+
+/* Compiles the configured files into a new policy. Returns NULL if one of
+   them can't be read; the old policy stays then. */
+static struct policy_t *policy_compile(void)
+{
+    struct policy_t *p;
+    int n;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        return NULL;
+    p->size = 1 << 16;
+    p->used = 8; // offset 0 marks an empty slot
+    p->num_slots = 1 << 12;
+    p->arena = malloc(p->size);
+    p->slots = calloc(p->num_slots, sizeof(p->slots[0]));
+    if (!p->arena || !p->slots) {
+        policy_free(p);
+        return NULL;
+    }
+
+    if (hosts_file != NULL) {
+        if ((n = policy_read(p, hosts_file, POLICY_HOST)) < 0)
+            goto fail;
+        p->hosts = n;
+    }
+    if (zones_file != NULL) {
+        if ((n = policy_read(p, zones_file, POLICY_ZONE)) < 0)
+            goto fail;
+        p->zones = n;
+    }
+    if (block_file != NULL) {
+        if ((n = policy_read(p, block_file, POLICY_BLOCK)) < 0)
+            goto fail;
+        p->blocked = n;
+    }
+    return p;
+
+fail:
+    policy_free(p);
+    return NULL;
+}
+
+/* Compiles the policy from the given files, any of which may be NULL.
+   Returns 0 if one can't be read. */
+int policy_init(const char *hosts, const char *zones, const char *blocklist)
+{
+    struct policy_t *p;
+    unsigned long long start = now_ms();
+
+    hosts_file = hosts;
+    zones_file = zones;
+    block_file = blocklist;
+    if (hosts == NULL && zones == NULL && blocklist == NULL)
+        return 1;
+    if ((p = policy_compile()) == NULL)
+        return 0;
+    printf("policy: %u names from %u hosts, %u zone and %u blocklist lines in %llu ms\n",
+           p->names, p->hosts, p->zones, p->blocked, now_ms() - start);
+    policy_current = p;
+    return 1;
+}
+
+/* Picks up the latest policy for the calling worker; the reload thread
+   frees an old one once no worker uses it anymore. The reload may swap
+   policies between the load and the store, after the thread looked at
+   policy_used, so the worker only goes on once what it published is still
+   the current one; sequentially consistent, so that the thread then sees
+   it. */
+void policy_refresh(int worker)
+{
+    do {
+        policy = __atomic_load_n(&policy_current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&policy_used[worker], policy, __ATOMIC_SEQ_CST);
+    } while (policy != __atomic_load_n(&policy_current, __ATOMIC_SEQ_CST));
+}
+
+/* Waits for SIGHUP, compiles the files again and swaps the new policy in.
+   Every other thread has SIGHUP blocked, see policy_start(). */
+static void *policy_thread(void *arg)
+{
+    sigset_t *set = arg;
+    struct policy_t *p, *old;
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    unsigned long long start;
+    int sig, i, busy;
+
+    for (;;) {
+        if (sigwait(set, &sig) != 0)
+            continue;
+        start = now_ms();
+        if ((p = policy_compile()) == NULL) {
+            printf("policy reload failed, keeping the old one\n");
+            continue;
+        }
+        printf("policy reloaded: %u names from %u hosts, %u zone and %u blocklist lines in %llu ms\n",
+               p->names, p->hosts, p->zones, p->blocked, now_ms() - start);
+        old = __atomic_exchange_n(&policy_current, p, __ATOMIC_SEQ_CST);
+
+        // workers move on at their next loop, a second at the latest
+        do {
+            busy = 0;
+            for (i = 0; i < MAX_WORKERS; i++)
+                busy |= __atomic_load_n(&policy_used[i], __ATOMIC_SEQ_CST) == old && old != NULL;
+            if (busy)
+                nanosleep(&pause, NULL);
+        } while (busy);
+        policy_free(old);
+    }
+    return NULL;
+}
+
+/* Blocks SIGHUP in the calling thread, and so in the workers it starts
+   after this, and starts the reload thread. Returns 0 on failure. */
+int policy_start(void)
+{
+    static sigset_t set;
+    pthread_t tid;
+    int r;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    if ((r = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0
+        || (r = pthread_create(&tid, NULL, policy_thread, &set)) != 0) {
+        printf("can't start the policy reload thread: %s\n", strerror(r));
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/* Looks the question keyed k up in the worker's policy. Returns
+   POLICY_PASS for questions that go upstream as usual; for POLICY_ADDR
+   addr is the name's address. */
+POLICY_ACTION policy_lookup(const struct dns_key_t *k, struct in_addr *addr)
+{
+    const struct policy_name_t *n;
+    int len, off;
+
+    if (policy == NULL || k->kl < 6 || ((k->k[k->kl - 3] << 8) | k->k[k->kl - 2]) != DNS_CLASS_IN)
+        return POLICY_PASS;
+    // the name, its terminating 0 included
+    len = k->kl - 5;
+
+    if ((n = policy_find(policy, k->k, len, policy_hash(k->k, len))) != NULL
+        && (n->flags & POLICY_HOST)) {
+        memcpy(&addr->s_addr, n->addr, 4);
+        return POLICY_ADDR;
+    }
+    for (off = 0; k->k[off] != 0; off += k->k[off] + 1) {
+        if ((n = policy_find(policy, k->k + off, len - off, policy_hash(k->k + off, len - off))) == NULL)
+            continue;
+        if (n->flags & POLICY_BLOCK)
+            return POLICY_BLOCKED;
+        if (n->flags & POLICY_ZONE)
+            return off == 0 ? POLICY_NODATA : POLICY_NXDOMAIN;
+    }
+    return POLICY_PASS;
+}
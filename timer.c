@@ -0,0 +1,202 @@
+/*
+ *  The Tor TCP DNS Daemon
+ *
+ *  Copyright (c) Collin R. Mulliner <collin(AT)mulliner.org>
+ *  Copyright (c) 2010, The Tor Project, Inc.
+ *
+ *  Timer wheel: millisecond deadlines in four levels of 64 slots each, the
+ *  lowest covering the next 64 ms. Setting and cancelling a timeout is
+ *  O(1); a timeout is moved down a level at most three times before it
+ *  expires, so running them costs about what expires.
+ *
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "ttdnsd.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+// the farthest a timeout can be filed ahead; later ones are filed again
+#define WHEEL_SPAN ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/* Every worker has a wheel of its own, so there's no locking */
+static __thread struct timeout_t wheel[WHEEL_LEVELS][WHEEL_SLOTS]; /**< slot list heads */
+static __thread unsigned long long wheel_now; /**< next ms to run */
+static __thread unsigned int armed; /**< timeouts on the wheel */
+
+static void slot_append(struct timeout_t *head, struct timeout_t *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void slot_unlink(struct timeout_t *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+/* Files t in the slot its expiry falls into, seen from wheel_now. */
+static void wheel_add(struct timeout_t *t)
+{
+    unsigned long long when = t->expire < wheel_now ? wheel_now : t->expire;
+    unsigned long long delta = when - wheel_now;
+    int level;
+
+    if (delta > WHEEL_SPAN) {
+        when = wheel_now + WHEEL_SPAN;
+        delta = WHEEL_SPAN;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+    slot_append(&wheel[level][(when >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+/* Starts the wheel of the calling worker at now. */
+void timeouts_init(unsigned long long now)
+{
+    int l, s;
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+        for (s = 0; s < WHEEL_SLOTS; s++)
+            wheel[l][s].prev = wheel[l][s].next = &wheel[l][s];
+    }
+    wheel_now = now;
+    armed = 0;
+}
+
+/* Prepares t to call fn(arg) when it expires; t isn't set yet. */
+void timeout_init(struct timeout_t *t, void (*fn)(void *arg), void *arg)
+{
+    t->prev = t->next = NULL;
+    t->expire = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+int timeout_pending(const struct timeout_t *t)
+{
+    return t->next != NULL;
+}
+
+/* (Re)sets t to expire at the given ms, see now_ms(). */
+void timeout_set(struct timeout_t *t, unsigned long long expire)
+{
+    if (timeout_pending(t))
+        slot_unlink(t);
+    else
+        armed++;
+    t->expire = expire;
+    wheel_add(t);
+}
+
+void timeout_cancel(struct timeout_t *t)
+{
+    if (!timeout_pending(t))
+        return;
+    slot_unlink(t);
+    armed--;
+}
+
+/* Files the timeouts of a higher level slot one level further down. */
+static void wheel_cascade(struct timeout_t *head)
+{
+    struct timeout_t *t;
+
+    while ((t = head->next) != head) {
+        slot_unlink(t);
+        wheel_add(t);
+    }
+}
+
+/* Calls every timeout that expired by now. A callback may set and cancel
+   timeouts, including the one it was called for. */
+void timeouts_run(unsigned long long now)
+{
+    struct timeout_t due;
+    struct timeout_t *t;
+    unsigned long long tick;
+    int level;
+
+    while (wheel_now <= now) {
+        if (armed == 0) {
+            wheel_now = now + 1;
+            return;
+        }
+        tick = wheel_now;
+        if ((tick & WHEEL_MASK) == 0) {
+            for (level = 1; level < WHEEL_LEVELS; level++) {
+                unsigned int slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+                wheel_cascade(&wheel[level][slot]);
+                if (slot != 0)
+                    break;
+            }
+        }
+        wheel_now = tick + 1;
+
+        // taken off the wheel first, timeouts set by the callbacks go to later slots
+        due.prev = due.next = &due;
+        while ((t = wheel[0][tick & WHEEL_MASK].next) != &wheel[0][tick & WHEEL_MASK]) {
+            slot_unlink(t);
+            slot_append(&due, t);
+        }
+        while ((t = due.next) != &due) {
+            slot_unlink(t);
+            armed--;
+            t->fn(t->arg);
+        }
+    }
+}
+
+/* Returns how many ms the event loop may sleep until timeouts_run() has
+   something to do, or -1 if no timeout is set. Timeouts in the higher
+   levels count from when their slot gets cascaded. */
+int timeouts_next(unsigned long long now)
+{
+    unsigned long long best = 0;
+    unsigned long long t;
+    int level, i;
+
+    if (armed == 0)
+        return -1;
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        t = wheel_now + i;
+        if (wheel[0][t & WHEEL_MASK].next != &wheel[0][t & WHEEL_MASK]) {
+            best = t;
+            break;
+        }
+    }
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+
+        for (i = 1; i <= WHEEL_SLOTS; i++) {
+            struct timeout_t *head;
+
+            t = ((wheel_now >> shift) + i) << shift;
+            if (best != 0 && t >= best)
+                break;
+            head = &wheel[level][(t >> shift) & WHEEL_MASK];
+            if (head->next != head) {
+                best = t;
+                break;
+            }
+        }
+    }
+
+    if (best <= now)
+        return 0;
+    return best - now > INT_MAX ? INT_MAX : (int)(best - now);
+}
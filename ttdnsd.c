@@ -9,6 +9,7 @@
  *
  */
 
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -16,15 +17,21 @@
 #include <fcntl.h>
 #include <string.h>
 #include <getopt.h>
+#include <signal.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <pthread.h>
 #include "ttdnsd.h"
 
 /*
@@ -38,507 +45,3591 @@
 static struct in_addr *nameservers; /**< nameservers pool */
 static unsigned int num_nameservers; /**< number of nameservers */
 
-static struct peer_t peers[MAX_PEERS]; /**< TCP peers */
-static struct request_t requests[MAX_REQUESTS]; /**< request queue */
-static int udp_fd; /**< port 53 socket */
+static int num_workers = DEFAULT_WORKERS; /**< event loops, see -w */
+static int num_peers = DEFAULT_PEERS; /**< peers in use per worker */
+static struct sockaddr_in socks_addr; /**< the SOCKS proxy, usually Tor */
+static int max_requests = DEFAULT_MAX_REQUESTS; /**< size of each pool */
+static int load_factor = DEFAULT_LOAD_FACTOR; /**< percent of index in use */
+static unsigned int cache_size = DEFAULT_CACHE_SIZE; /**< answer cache entries */
+static unsigned int stale_window = DEFAULT_STALE_WINDOW; /**< seconds, 0 disables serve-stale */
+static int stale_deadline = DEFAULT_STALE_DEADLINE; /**< ms until a stale answer is served */
+static unsigned int refresh_ahead = DEFAULT_REFRESH_AHEAD; /**< seconds, 0 disables prefetching */
+static int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL; /**< seconds, 0 disables snapshots */
+static int snapshot_fds[MAX_WORKERS]; /**< snapshot file of each worker to load, opened as root */
+static int snapshot_busy[MAX_WORKERS]; /**< a snapshot of the worker is being written */
+static int snapshot_loaded; /**< workers done loading, the last closes snapshot_fds */
+static int block_zero; /**< blocked names get 0.0.0.0 rather than NXDOMAIN */
+static int udp_batch = DEFAULT_UDP_BATCH; /**< datagrams per syscall */
+static int hedge_budget = DEFAULT_HEDGE_BUDGET; /**< percent of queries hedged */
+static int max_tries = DEFAULT_TRIES; /**< upstream tries per request */
+static int tor_resolve; /**< A and PTR queries go by SOCKS RESOLVE */
+static int min_warm = DEFAULT_MIN_WARM; /**< connections kept open per worker */
+static int race = DEFAULT_RACE; /**< connection attempts raced, see peer_race() */
+static int window = DEFAULT_WINDOW; /**< requests per connection */
+static int queue_max = DEFAULT_QUEUE; /**< admission queue bound */
+static int shed_rcode = DNS_RCODE_SERVFAIL; /**< answer to shed requests, -1 for none */
+static int client_inflight = DEFAULT_CLIENT_INFLIGHT; /**< requests per client address */
+static int client_rate = DEFAULT_CLIENT_RATE; /**< queries per second and address, 0 for no limit */
+static int tcp_clients_max = DEFAULT_TCP_CLIENTS; /**< client connections per worker, 0 disables TCP */
+static int tcp_pipeline = DEFAULT_TCP_PIPELINE; /**< requests in flight per client connection */
+static int tcp_idle = DEFAULT_TCP_IDLE; /**< seconds */
+static volatile sig_atomic_t stats_generation; /**< bumped by SIGUSR1 */
+static volatile sig_atomic_t stopping; /**< set by SIGTERM and SIGINT */
+static EV_TYPE udp_ev = EV_UDP; /**< epoll context of udp_fd */
+static EV_TYPE tcp_listen_ev = EV_TCP_LISTEN; /**< epoll context of tcp_listen_fd */
 
-/*
-Someday:
-static int multipeer = 0;
-static int multireq = 0;
-*/
+/* Everything below belongs to one worker's event loop. Workers share no
+   mutable state, so none of it needs locking. */
+static __thread int worker_id; /**< 0 is the main thread */
+static __thread sig_atomic_t stats_seen; /**< last stats_generation dumped */
+static __thread struct peer_t peers[MAX_PEERS]; /**< TCP peers */
+static __thread struct peer_t *dirty_peers[MAX_PEERS]; /**< peers with output to flush */
+static __thread int num_dirty; /**< entries in dirty_peers */
+static __thread struct request_t *requests; /**< request pool */
+static __thread struct request_t *free_requests; /**< unused slots, linked through next */
+static __thread struct request_t **request_index; /**< client address and id -> request */
+static __thread unsigned int index_size; /**< power of two */
+static __thread unsigned int index_used; /**< live entries plus tombstones */
+static __thread struct request_t index_tombstone; /**< marks deleted index slots */
+static __thread struct request_t **question_index; /**< question -> request in flight */
+static __thread unsigned int question_size; /**< power of two */
+static __thread unsigned long coalesced; /**< requests answered along with another */
+static __thread unsigned long retries; /**< tries after the first */
+static __thread unsigned long servfails; /**< requests given up on */
+static __thread int udp_fd; /**< port 53 socket */
+static __thread int epoll_fd; /**< the event loop */
+static __thread struct request_t *udp_in; /**< where recvmmsg() puts requests */
+static __thread struct iovec *udp_in_iov;
+static __thread struct mmsghdr *udp_in_msgs;
+static __thread struct sockaddr_in *udp_out_addr; /**< answers waiting for sendmmsg() */
+static __thread struct iovec *udp_out_iov;
+static __thread struct mmsghdr *udp_out_msgs;
+static __thread int udp_out_len; /**< answers queued */
+static __thread int udp_out_sent; /**< of those, taken by the socket already */
+static __thread int udp_out_refs; /**< queued straight from a peer's receive buffer, see answer_forward() */
+static __thread unsigned char *udp_out_buf; /**< copies of the queued answers */
+static __thread int udp_out_size; /**< size of udp_out_buf */
+static __thread int udp_out_used; /**< bytes of udp_out_buf in use */
+static __thread unsigned char *udp_out_next; /**< where the next answer goes, see udp_answer_reserve() */
+static __thread unsigned char *udp_spill; /**< takes answers there's no room for, see udp_answer_reserve() */
+static __thread int udp_blocked; /**< the socket buffer is full, waiting for EPOLLOUT */
+static __thread unsigned long udp_blocks, udp_dropped; /**< see udp_flush() */
+static __thread unsigned long udp_rx_batches, udp_rx_msgs, udp_rx_full; /**< batch fill */
+static __thread unsigned long udp_tx_batches, udp_tx_msgs, udp_tx_full;
+static __thread unsigned long udp_truncated; /**< answers too large for the client's UDP */
+static __thread int tcp_listen_fd = -1; /**< port 53 listener, see tcp_accept() */
+static __thread struct tcp_client_t *tcp_clients; /**< tcp_clients_max of them */
+static __thread struct tcp_client_t *free_tcp_clients; /**< unused slots, linked through next */
+static __thread struct tcp_client_t *resume_tcp_clients; /**< to read again, see tcp_clients_resume() */
+static __thread struct tcp_client_t *held_tcp_clients; /**< see tcp_client_hold() */
+static __thread struct request_t tcp_in; /**< where queries off TCP are taken apart */
+static __thread int tcp_open; /**< client connections open */
+static __thread unsigned long tcp_accepted, tcp_refused, tcp_queries, tcp_idle_closed, tcp_holds;
+static __thread unsigned int rtt_samples[RTT_SAMPLES]; /**< recent latencies in ms */
+static __thread unsigned int rtt_count; /**< samples taken so far */
+static __thread int rtt_fresh; /**< samples taken since hedge_delay was computed */
+static __thread unsigned int hedge_delay = HEDGE_DEFAULT_MS; /**< ms before hedging */
+static __thread int hedge_credit; /**< hedges allowed, in hundredths */
+static __thread unsigned long hedges_sent, hedges_won;
+static __thread struct timeout_t housekeeping_timer; /**< see housekeeping() */
+static __thread struct ns_stats_t ns_stats[MAX_NAMESERVERS]; /**< see ns_select() */
+static __thread struct resolve_t resolves[MAX_RESOLVES]; /**< see resolve_start() */
+static __thread struct resolve_t *free_resolves; /**< unused slots, linked through next */
+static __thread unsigned long resolves_sent, resolves_answered, resolves_failed;
+static __thread unsigned long probes_sent, rotations; /**< see peer_probe(), peer_rotate() */
+static __thread unsigned int race_seq; /**< last peer_t.race handed out */
+static __thread unsigned long races, races_moved; /**< races started, requests moved */
+static __thread int admission_len; /**< requests waiting for a window, see admission_add() */
+static __thread struct client_t admission_round; /**< clients with requests queued, in turn */
+static __thread struct client_t *clients; /**< 2 * max_requests of them */
+static __thread struct client_t *client_hash[CLIENT_BUCKETS];
+static __thread struct client_t *free_clients;
+static __thread struct client_t idle_clients; /**< without requests, least recently used first */
+static __thread struct client_t local_client; /**< charged for prefetches */
+static __thread unsigned long throttled; /**< requests over a client's limits */
+static __thread int udp_paused; /**< udp_fd left unread while admission is full */
+static __thread unsigned long admitted, shed, udp_pauses; /**< see admission_drain() */
+static __thread unsigned long long admission_wait; /**< ms the admitted requests waited */
+static __thread unsigned int admission_wait_max;
+static __thread int admission_peak; /**< longest the queue got */
+static __thread unsigned long stale_served, stale_rescues; /**< at the deadline, instead of errors */
+static __thread unsigned long prefetches; /**< see request_prefetch() */
+static __thread struct timeout_t snapshot_timer; /**< see snapshot_save() */
+static __thread unsigned long policy_local, policy_blocked; /**< see policy_answer() */
 
-/* Return a positive positional number or -1 for unfound entries. */
-int request_find(uint id)
+/* Milliseconds on the monotonic clock, for latencies and short delays */
+unsigned long long now_ms(void)
 {
-    uint pos = id % MAX_REQUESTS;
+    struct timespec ts;
 
-    for (;;) {
-        if (requests[pos].id == id) {
-            printf("found id=%d at pos=%d\n", id, pos);
-            return pos;
-        }
-        else {
-            pos++;
-            pos %= MAX_REQUESTS;
-            if (pos == (id % MAX_REQUESTS)) {
-                printf("can't find id=%d\n", id);
-                return -1;
-            }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Sets up the request pool and the id index for max_requests requests with
+   the index at most load_factor percent full. Returns 1 on success. */
+static int request_init(void)
+{
+    int i;
+
+    if (!(requests = calloc(max_requests, sizeof(requests[0]))))
+        return 0;
+    free_requests = NULL;
+    for (i = max_requests - 1; i >= 0; i--) {
+        requests[i].next = free_requests;
+        free_requests = &requests[i];
+    }
+
+    for (index_size = 16; index_size * load_factor < (unsigned int)max_requests * 100; index_size <<= 1);
+    if (!(request_index = calloc(index_size, sizeof(request_index[0]))))
+        return 0;
+    index_used = 0;
+
+    for (question_size = 16; question_size < (unsigned int)max_requests; question_size <<= 1);
+    if (!(question_index = calloc(question_size, sizeof(question_index[0]))))
+        return 0;
+    return 1;
+}
+
+/* Multiplicative hash; ids are chosen by clients and may well be sequential */
+static unsigned int request_slot(const struct sockaddr_in *a, uint rid)
+{
+    unsigned int h = (a->sin_addr.s_addr ^ ((uint)a->sin_port << 16) ^ rid) * 2654435761U;
+
+    return (h ^ (h >> 16)) & (index_size - 1);
+}
+
+/* Returns the live request a client sent with id rid or NULL. Probing stops
+   at the first never-used slot and steps over tombstones. Answers don't
+   need this, see peer_t.inflight; it catches retransmissions. */
+struct request_t *request_find(const struct sockaddr_in *a, uint rid)
+{
+    unsigned int pos = request_slot(a, rid);
+    struct request_t *r;
+
+    while ((r = request_index[pos]) != NULL) {
+        if (r != &index_tombstone && r->rid == (int)rid
+            && r->a.sin_addr.s_addr == a->sin_addr.s_addr && r->a.sin_port == a->sin_port)
+            return r;
+        pos = (pos + 1) & (index_size - 1);
+    }
+    return NULL;
+}
+
+/* Rebuilds the index without tombstones once they take up half of the
+   headroom the load factor leaves. */
+static void request_index_rehash(void)
+{
+    unsigned int pos;
+    int i;
+
+    if (index_used * 200 < index_size * (100 + load_factor))
+        return;
+    memset(request_index, 0, index_size * sizeof(request_index[0]));
+    index_used = 0;
+    for (i = 0; i < max_requests; i++) {
+        if (requests[i].active == UNUSED)
+            continue;
+        for (pos = request_slot(&requests[i].a, requests[i].rid); request_index[pos] != NULL;
+             pos = (pos + 1) & (index_size - 1));
+        request_index[pos] = &requests[i];
+        index_used++;
+    }
+}
+
+/* Indexes r by client address and id, reusing the first tombstone. */
+static void request_index_add(struct request_t *r)
+{
+    unsigned int pos = request_slot(&r->a, r->rid);
+
+    while (request_index[pos] != NULL && request_index[pos] != &index_tombstone)
+        pos = (pos + 1) & (index_size - 1);
+    if (request_index[pos] == NULL)
+        index_used++;
+    request_index[pos] = r;
+    request_index_rehash();
+}
+
+static void request_index_remove(struct request_t *r)
+{
+    unsigned int pos = request_slot(&r->a, r->rid);
+
+    while (request_index[pos] != NULL) {
+        if (request_index[pos] == r) {
+            request_index[pos] = &index_tombstone;
+            return;
         }
+        pos = (pos + 1) & (index_size - 1);
+    }
+}
+
+/* Returns the request in flight for the same question as r, if any. */
+static struct request_t *question_find(const struct request_t *r)
+{
+    struct request_t *q;
+
+    if (r->qend < 0)
+        return NULL;
+    for (q = question_index[r->qhash & (question_size - 1)]; q != NULL; q = q->qnext) {
+        if (q->qhash == r->qhash && q->key.kl == r->key.kl
+            && memcmp(q->key.k, r->key.k, r->key.kl) == 0)
+            return q;
+    }
+    return NULL;
+}
+
+/* Makes r the request in flight for its question; later identical requests
+   wait on it instead of going upstream. */
+static void question_add(struct request_t *r)
+{
+    struct request_t **head = &question_index[r->qhash & (question_size - 1)];
+
+    r->qnext = NULL;
+    if (r->qend < 0)
+        return;
+    r->qnext = *head;
+    *head = r;
+}
+
+static void question_remove(struct request_t *r)
+{
+    struct request_t **pp = &question_index[r->qhash & (question_size - 1)];
+
+    if (r->qend < 0)
+        return;
+    while (*pp != NULL && *pp != r)
+        pp = &(*pp)->qnext;
+    if (*pp != NULL)
+        *pp = r->qnext;
+    r->qnext = NULL;
+}
+
+/* Fills buf with len bytes from the kernel's random pool; getrandom()
+   needs no device node, so it works in the chroot. Returns 1 on success. */
+static int random_fill(void *buf, size_t len)
+{
+    unsigned char *b = buf;
+    ssize_t ret;
+    int fd;
+
+    while (len > 0) {
+        ret = getrandom(b, len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == ENOSYS)
+            break;
+        if (ret <= 0)
+            return 0;
+        b += ret;
+        len -= ret;
+    }
+    if (len == 0)
+        return 1;
+
+    // kernels before 3.17, outside of a chroot
+    if ((fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC)) < 0)
+        return 0;
+    while (len > 0) {
+        ret = read(fd, b, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        b += ret;
+        len -= ret;
+    }
+    close(fd);
+    return len == 0;
+}
+
+/* Gives the peer its upstream id space: a ring of the free ids 1-65535 in
+   random order and the id -> request table answers are looked up in.
+   Returns 1 on success. */
+static int peer_init(struct peer_t *p)
+{
+    unsigned int rnd[256];
+    unsigned int i, j, n;
+    unsigned short t;
+
+    p->ev = EV_PEER;
+    p->tcp_fd = -1;
+    p->con = DEAD;
+    memset(&p->pending, 0, sizeof(p->pending));
+    memset(&p->sent, 0, sizeof(p->sent));
+    if (!(p->id_free = malloc(PEER_IDS * sizeof(p->id_free[0]))))
+        return 0;
+    if (!(p->inflight = calloc(PEER_IDS + 1, sizeof(p->inflight[0]))))
+        return 0;
+    if (!(p->ob = malloc(PEER_OBUF_SIZE)))
+        return 0;
+    if (!(p->b = malloc(PEER_RBUF_SIZE)))
+        return 0;
+    p->bsize = PEER_RBUF_SIZE;
+    p->bl = p->rpos = 0;
+    p->ob_head = p->ob_len = 0;
+    p->dirty = 0;
+    for (i = 0; i < PEER_IDS; i++)
+        p->id_free[i] = i + 1;
+    // Fisher-Yates with kernel randomness, so ids can't be predicted from
+    // the order of queries or the start time
+    for (i = PEER_IDS - 1, n = 0; i > 0; i--, n++) {
+        if (n % 256 == 0 && !random_fill(rnd, sizeof(rnd)))
+            return 0;
+        j = rnd[n % 256] % (i + 1);
+        t = p->id_free[i];
+        p->id_free[i] = p->id_free[j];
+        p->id_free[j] = t;
     }
+    p->id_head = 0;
+    p->id_count = PEER_IDS;
+    return 1;
+}
+
+/* Hands out the least recently freed id of the peer, so a late answer to
+   an earlier request is unlikely to hit a new one. Returns 0 if all ids are
+   in flight. */
+static uint peer_id_alloc(struct peer_t *p, struct request_t *r)
+{
+    uint id;
+
+    if (p->id_count == 0)
+        return 0;
+    id = p->id_free[p->id_head];
+    p->id_head = (p->id_head + 1) % PEER_IDS;
+    p->id_count--;
+    p->inflight[id] = r;
+    return id;
 }
 
+static void peer_id_free(struct peer_t *p, uint id)
+{
+    p->inflight[id] = NULL;
+    p->id_free[(p->id_head + p->id_count) % PEER_IDS] = id;
+    p->id_count++;
+}
 
-/* Returns a display name for the peer; currently inet_ntoa, so
-   statically allocated */
+/* Returns a display name for the peer, the nameserver it is bound to;
+   currently inet_ntoa, so statically allocated */
 static const char *peer_display(struct peer_t *p) 
 {
-    return inet_ntoa(p->tcp.sin_addr);
+    return inet_ntoa(p->ns);
 }
 
-/* Returns 1 upon non-blocking connection setup; 0 upon serious error */
-int peer_connect(struct peer_t *p, struct in_addr ns)
+/* Smooths the answer latency of the peer's nameserver; the query answered
+   on it went out at sent_ms. */
+static void ns_answered(struct peer_t *p, unsigned long long sent_ms)
 {
-    int socket_opt_val = 1;
-    int cs;
-    unsigned char message[1000];
-    unsigned char  server_reply[2000];
-    int port=53;
-    char *host;
+    struct ns_stats_t *s = &ns_stats[p->nsi];
+    unsigned long long rtt = now_ms() - sent_ms;
+
+    if (rtt > RTO_MAX_MS)
+        rtt = RTO_MAX_MS;
+    if (s->answers++ == 0 || s->srtt == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        // RFC 6298: rttvar first, with the old srtt
+        long long err = (long long)rtt - (long long)s->srtt;
+
+        s->rttvar += ((err < 0 ? -err : err) - (long long)s->rttvar) / 4;
+        s->srtt += err / (1 << NS_RTT_SHIFT);
+    }
+    s->timeout_rate -= s->timeout_rate >> NS_RATE_SHIFT;
+    s->rto_backoff = 0;
+}
+
+/* How long a try on nameserver nsi may take, in ms: doubled for every
+   timeout since its last answer, see RFC 6298 5.5. */
+static unsigned int ns_rto(int nsi)
+{
+    struct ns_stats_t *s = &ns_stats[nsi];
+    unsigned long long rto = s->srtt + 4 * s->rttvar;
+
+    if (s->answers == 0)
+        rto = RTO_INITIAL_MS;
+    if (rto < RTO_MIN_MS)
+        rto = RTO_MIN_MS;
+    rto <<= s->rto_backoff;
+    return rto > RTO_MAX_MS ? RTO_MAX_MS : rto;
+}
+
+/* Gives r the deadline of a try queued on p; it is moved forward once the
+   request is actually sent, see peer_sendreq(). */
+static void request_set_deadline(struct request_t *r, struct peer_t *p)
+{
+    timeout_set(&r->deadline, now_ms() + (p->con == CONNECTED ? ns_rto(p->nsi) : RTO_INITIAL_MS));
+}
+
+/* A query sent to the peer's nameserver got no answer in time. */
+static void ns_timed_out(struct peer_t *p)
+{
+    struct ns_stats_t *s = &ns_stats[p->nsi];
+
+    s->timeouts++;
+    s->timeout_rate += (1000 - s->timeout_rate) >> NS_RATE_SHIFT;
+    // RTO_MAX_MS is reached long before this
+    if (s->rto_backoff < 8)
+        s->rto_backoff++;
+}
 
-    char length[2];
-    char portC[2];
-    int res;
+static void ns_connected(struct peer_t *p)
+{
+    struct ns_stats_t *s = &ns_stats[p->nsi];
+
+    s->connects++;
+    s->fails = 0;
+    s->backoff_until = 0;
+    s->fail_rate -= s->fail_rate >> NS_RATE_SHIFT;
+}
+
+/* The exit couldn't reach the peer's nameserver: it is skipped for a while,
+   twice as long for every failure in a row. */
+static void ns_failed(struct peer_t *p)
+{
+    struct ns_stats_t *s = &ns_stats[p->nsi];
+    time_t backoff = NS_BACKOFF_MAX;
 
+    s->failures++;
+    s->fail_rate += (1000 - s->fail_rate) >> NS_RATE_SHIFT;
+    if (s->fails < 16 && (NS_BACKOFF_MIN << s->fails) < NS_BACKOFF_MAX)
+        backoff = NS_BACKOFF_MIN << s->fails;
+    s->fails++;
+    s->backoff_until = time(NULL) + backoff;
+    printf("nameserver %s failed %u times in a row, skipping it for %ld s\n",
+           peer_display(p), s->fails, (long)backoff);
+}
 
+/* Starts a non-blocking connection through the SOCKS proxy to nameserver
+   nsi of the pool; the SOCKS handshake is driven by peer_handshake() from
+   the event loop. Returns 1 upon non-blocking connection setup; 0 upon
+   serious error */
+int peer_connect(struct peer_t *p, int nsi)
+{
+    int socket_opt_val = 1;
+    int cs;
+    struct epoll_event ev;
 
-    if (p->con == CONNECTING || p->con == CONNECTING2) {
+    if (p->con != DEAD && p->con != CONNECTED) {
         printf("It appears that peer %s is already CONNECTING\n",
                peer_display(p));
         return 1;
     }
 
-
     if ((p->tcp_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         printf("Can't create TCP socket\n");
         return 0;
     }
+    p->nsi = nsi;
+    p->ns = nameservers[nsi];
+    p->bl = p->rpos = 0;
+    p->generation++;
+    p->draining = 0;
+    p->race = 0;
+    timeout_set(&p->timer, now_ms() + SOCKS_TIMEOUT * 1000ULL);
 
+    if (setsockopt(p->tcp_fd, SOL_SOCKET, SO_REUSEADDR, &socket_opt_val, sizeof(int)))
+         printf("Setting SO_REUSEADDR failed\n");
 
+    if (fcntl(p->tcp_fd, F_SETFL, O_NONBLOCK))
+        printf("Setting O_NONBLOCK failed\n");
 
-    p->tcp.sin_family = AF_INET;
-
-//     This should not be hardcoded to a magic number;
-//     per ns port data structure changes required
-    p->tcp.sin_port = htons(9050);
+    // registered once for everything; close() takes it off the epoll set
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+    ev.data.ptr = p;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->tcp_fd, &ev) < 0) {
+        perror("epoll_ctl on TCP fd");
+        close(p->tcp_fd);
+        p->tcp_fd = -1;
+        return 0;
+    }
 
-    p->tcp.sin_addr.s_addr = inet_addr("127.0.0.1");
+    memcpy(&p->tcp, &socks_addr, sizeof(p->tcp));
 
     printf("--------------- New connection -----------------\n");
-    printf("connecting to %s on port %i\n", peer_display(p), ntohs(p->tcp.sin_port));
+    printf("connecting to %s through %s:%i\n", peer_display(p),
+           inet_ntoa(p->tcp.sin_addr), ntohs(p->tcp.sin_port));
 
     cs = connect(p->tcp_fd, (struct sockaddr*)&(p->tcp), sizeof(p->tcp));
+    if (cs != 0 && errno != EINPROGRESS) {
+        perror("connect status");
+        close(p->tcp_fd);
+        p->tcp_fd = -1;
+        return 0;
+    }
+
+    // writability tells us when the connect is done, see peer_connected()
+    p->con = CONNECTING;
+    return 1;
+}
+
+/* Sends a handshake message in one go. The messages are tiny and go out on
+   a fresh connection, so a short write means something is badly wrong.
+   Returns 1 on success, 0 on error. */
+static int peer_socks_send(struct peer_t *p, const unsigned char *m, int len)
+{
+    int ret = write(p->tcp_fd, m, len);
 
-    if (cs<0)
-    {
-        puts("error");
+    if (ret != len) {
+        printf("SOCKS handshake write to %s failed (%d of %d bytes)\n",
+               peer_display(p), ret, len);
         return 0;
     }
-    else
-        puts("Connected\n");
+    return 1;
+}
+
+/* Builds the RFC 1929 username/password subnegotiation for user, who is
+   their own password, in m (3 + 2 * 63 bytes). Returns its length. */
+static int socks_auth_message(unsigned char *m, const char *user)
+{
+    int ul = strlen(user);
 
-    /*
-      * Initialise connection with socks5
-      *
-      */
+    m[0] = 1;
+    m[1] = ul;
+    memcpy(m + 2, user, ul);
+    m[2 + ul] = ul;
+    memcpy(m + 3 + ul, user, ul);
+    return 3 + 2 * ul;
+}
 
-    message[0]=5;
-    message[1]=1;
-    message[2]=0;
-    message[3]='\0';
+/* Sends the RFC 1929 username/password subnegotiation. Tor puts streams
+   with different credentials on different circuits (IsolateSOCKSAuth), so
+   every connection of the pool gets a circuit of its own. */
+static int peer_socks_auth(struct peer_t *p)
+{
+    unsigned char m[3 + 2 * 64];
+    char user[64];
 
-    //Sending identification data to socks5 proxy
-    if( send(p->tcp_fd , message , 3 , 0) < 0) {
-        puts("Send failed");
-        return 1;
+    snprintf(user, sizeof(user), "ttdnsd-%d-%d-%ld-%u", (int)getpid(),
+             worker_id, (long)(p - peers), p->generation);
+    p->con = SOCKS_AUTH;
+    return peer_socks_send(p, m, socks_auth_message(m, user));
+}
+
+/* Asks the proxy to connect to port 53 of the peer's nameserver. */
+static int peer_socks_request(struct peer_t *p)
+{
+    unsigned char m[10];
+
+    m[0] = 5; // version
+    m[1] = 1; // CONNECT
+    m[2] = 0;
+    m[3] = 1; // IPv4 address
+    memcpy(m + 4, &p->ns.s_addr, 4);
+    m[8] = 0;
+    m[9] = 53;
+    p->con = SOCKS_REPLY;
+    return peer_socks_send(p, m, sizeof(m));
+}
+
+static const unsigned char socks_greeting[] = { 5, 2, 0, 2 }; // no auth, user/pass
+
+/* Returns 1 upon non-blocking connection; 0 upon serious error */
+int peer_connected(struct peer_t *p)
+{
+    /* Linux connect(2): "It is possible to select(2) or poll(2) for
+       completion by selecting the socket for writing.  After select(2)
+       indicates writability, use getsockopt(2) to read the SO_ERROR
+       option at level SOL_SOCKET to determine whether connect()
+       completed successfully" */
+    int error_code = 0;
+    socklen_t error_code_size = sizeof(error_code);
+
+    if (getsockopt(p->tcp_fd, SOL_SOCKET, SO_ERROR, &error_code, &error_code_size) < 0)
+        error_code = errno;
+
+    if (error_code != 0) {
+        printf("connection failed with code:%d\n",error_code);
+        printf("Is Tor running?\n");
+        return 0;
     }
 
-    //Receive a reply from the server
-    if( recv(p->tcp_fd , server_reply , 2000 , 0) < 0) {
-        puts("recv failed");
+    p->con = SOCKS_METHOD;
+    return peer_socks_send(p, socks_greeting, sizeof(socks_greeting));
+}
+
+/* Length of the CONNECT reply starting at b, or 0 if we can't tell yet */
+static int socks_reply_len(const unsigned char *b, int bl)
+{
+    if (bl < 5)
         return 0;
+    switch (b[3]) {
+    case 1:
+        return 4 + 4 + 2;
+    case 3:
+        return 4 + 1 + b[4] + 2;
+    case 4:
+        return 4 + 16 + 2;
+    default:
+        return -1;
     }
+}
 
-    message[0]=5;
-    message[1]=1;
-    message[2]=0;
-    message[3]=3;
+/* Consumes the proxy's reply to the current handshake step from the
+   receive buffer and sends the next message. Returns 1 once connected, 0 if
+   more bytes are needed, 2 if it advanced a step and -1 on failure. */
+static int peer_socks_step(struct peer_t *p)
+{
+    int ret;
+    int need;
 
-    /*
-      * Asking socks5 to connect to a specific DNS resolver
-      *
-      */
+    switch (p->con) {
+    case SOCKS_METHOD:
+        if (p->bl < 2)
+            return 0;
+        if (p->b[0] != 5 || (p->b[1] != 0 && p->b[1] != 2)) {
+            printf("SOCKS proxy refused our authentication methods\n");
+            return -1;
+        }
+        need = 2;
+        ret = (p->b[1] == 2) ? peer_socks_auth(p) : peer_socks_request(p);
+        break;
+    case SOCKS_AUTH:
+        if (p->bl < 2)
+            return 0;
+        if (p->b[1] != 0) {
+            printf("SOCKS proxy refused our credentials\n");
+            return -1;
+        }
+        need = 2;
+        ret = peer_socks_request(p);
+        break;
+    case SOCKS_REPLY:
+        if ((need = socks_reply_len(p->b, p->bl)) < 0 || (need > 0 && p->b[1] != 0)) {
+            printf("SOCKS proxy can't connect to %s (reply %d)\n", peer_display(p), p->b[1]);
+            return -1;
+        }
+        if (need == 0 || p->bl < need)
+            return 0;
+        printf("Connected to %s\n", peer_display(p));
+        p->con = CONNECTED;
+        ns_connected(p);
+        timeout_cancel(&p->timer);
+        p->connected_ms = now_ms();
+        timeout_set(&p->rotate, p->connected_ms + PEER_ROTATE_AFTER * 1000ULL);
+        ret = 1;
+        break;
+    case DEAD:
+    case CONNECTING:
+    case CONNECTED:
+    default:
+        return -1;
+    }
 
-    host=inet_ntoa(ns);
-    printf("Host: %s\n",host);
-    length[0]= strlen(host);
-    length[1]= 0;
+    // anything past the handshake message belongs to the next step
+    memmove(p->b, p->b + need, p->bl - need);
+    p->bl -= need;
+    if (!ret)
+        return -1;
+    return p->con == CONNECTED ? 1 : 2;
+}
 
-    portC[1]=port%256;
-    portC[0]=port/256;
+/* Drives the connection setup as far as it goes whenever the peer's socket
+   becomes ready. Returns 1 once the connection is usable, 0 while the
+   handshake is still in progress and -1 if it failed. */
+int peer_handshake(struct peer_t *p)
+{
+    int ret;
 
-    //Send initial message
-    if( send(p->tcp_fd , message , 4 , 0) < 0) {
-        puts("Send failed");
-        return 1;
+    if (p->con == CONNECTING) {
+        if (!peer_connected(p))
+            return -1;
     }
-    //Send hsotname lenth
-    if( send(p->tcp_fd, length , 1 , 0) < 0) {
-        puts("Send failed");
-        return 1;
+
+    for (;;) {
+        if ((ret = peer_socks_step(p)) == 2)
+            continue;
+        if (ret != 0)
+            return ret;
+
+        ret = read(p->tcp_fd, p->b + p->bl, p->bsize - p->bl);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return 0;
+        if (ret <= 0) {
+            printf("SOCKS proxy closed the connection to %s\n", peer_display(p));
+            return -1;
+        }
+        p->bl += ret;
     }
-    //Send hostname
-    if( send(p->tcp_fd , host , strlen(host) , 0) < 0) {
-        puts("Send failed");
-        return 1;
+}
+
+/* Appends r to the intrusive request list l. */
+static void request_list_append(struct request_list_t *l, struct request_t *r)
+{
+    r->list = l;
+    r->next = NULL;
+    r->prev = l->tail;
+    if (l->tail)
+        l->tail->next = r;
+    else
+        l->head = r;
+    l->tail = r;
+    l->len++;
+}
+
+/* Takes r off whatever request list it is on. */
+static void request_list_remove(struct request_t *r)
+{
+    struct request_list_t *l = r->list;
+
+    if (l == NULL)
+        return;
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        l->head = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    else
+        l->tail = r->prev;
+    l->len--;
+    r->list = NULL;
+    r->prev = r->next = NULL;
+}
+
+static void client_append(struct client_t *head, struct client_t *c)
+{
+    c->prev = head->prev;
+    c->next = head;
+    head->prev->next = c;
+    head->prev = c;
+}
+
+static void client_unlink(struct client_t *c)
+{
+    if (c->next == NULL)
+        return;
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    c->prev = c->next = NULL;
+}
+
+/* Sets up the client accounting of the worker. There are twice as many
+   entries as requests, so at least half of them are idle and can be
+   reused when the table is full. Returns 1 on success. */
+static int clients_init(void)
+{
+    int i;
+
+    if (!(clients = calloc(max_requests * 2, sizeof(clients[0]))))
+        return 0;
+    free_clients = NULL;
+    for (i = max_requests * 2 - 1; i >= 0; i--) {
+        clients[i].hnext = free_clients;
+        free_clients = &clients[i];
     }
-    //sendport
-    if( send(p->tcp_fd , portC , 2 , 0) < 0) {
-        puts("Send failed");
-        return 1;
+    idle_clients.prev = idle_clients.next = &idle_clients;
+    admission_round.prev = admission_round.next = &admission_round;
+    return 1;
+}
+
+static unsigned int client_bucket(struct in_addr addr)
+{
+    unsigned int h = addr.s_addr * 2654435761U;
+
+    return (h ^ (h >> 16)) & (CLIENT_BUCKETS - 1);
+}
+
+/* Returns the accounting of the client address addr, taking over the
+   least recently idle one for an address not seen before. The port isn't
+   part of it, stub resolvers pick a new one for every query. */
+static struct client_t *client_get(struct in_addr addr)
+{
+    struct client_t **pp;
+    struct client_t *c;
+
+    for (c = client_hash[client_bucket(addr)]; c != NULL; c = c->hnext) {
+        if (c->addr.s_addr == addr.s_addr)
+            return c;
+    }
+
+    if ((c = free_clients) != NULL) {
+        free_clients = c->hnext;
+    } else {
+        if ((c = idle_clients.next) == &idle_clients)
+            return &local_client;
+        client_unlink(c);
+        for (pp = &client_hash[client_bucket(c->addr)]; *pp != c; pp = &(*pp)->hnext);
+        *pp = c->hnext;
     }
+    memset(c, 0, sizeof(*c));
+    c->addr = addr;
+    c->used = 1;
+    c->tokens = client_rate * 1000ULL;
+    c->refilled = now_ms();
+    c->hnext = client_hash[client_bucket(addr)];
+    client_hash[client_bucket(addr)] = c;
+    client_append(&idle_clients, c);
+    return c;
+}
 
+/* Returns 1 if c may have another request in the table: it's below its
+   in-flight cap and, with --client-rate, has a token left for one that
+   goes upstream. A second's worth of queries can come in a burst. */
+static int client_admit(struct client_t *c, int upstream)
+{
+    unsigned long long now;
 
-    //Receive a reply from the server
-    if( (res=recv(p->tcp_fd , server_reply ,200 , 0)) < 0)
-    {
-        puts("recv failed");
+    if (c == &local_client)
+        return 1;
+    if (c->inflight >= client_inflight)
         return 0;
+    if (upstream && client_rate > 0) {
+        now = now_ms();
+        c->tokens += (now - c->refilled) * client_rate;
+        c->refilled = now;
+        if (c->tokens > client_rate * 1000ULL)
+            c->tokens = client_rate * 1000ULL;
+        if (c->tokens < 1000)
+            return 0;
+        c->tokens -= 1000;
     }
+    return 1;
+}
 
-    if (cs != 0 && errno != EINPROGRESS) {
-        perror("connect status");
-        return 0;
+/* Gives c back the token of a request that was admitted but didn't go
+   upstream after all. */
+static void client_refund(struct client_t *c)
+{
+    if (c != &local_client && client_rate > 0 && c->tokens + 1000 <= client_rate * 1000ULL)
+        c->tokens += 1000;
+}
+
+/* Charges c, and the TCP connection r came over if any, for r, which just
+   got its slot in the table. */
+static void client_charge(struct request_t *r, struct client_t *c)
+{
+    if (r->tcp != NULL)
+        r->tcp->inflight++;
+    r->client = c;
+    if (c->inflight++ == 0)
+        client_unlink(c);
+    c->requests++;
+}
+
+/* Puts r, which has no peer yet, in the admission queue: behind the other
+   requests of its client, whose turn comes round, see admission_drain(). */
+static void admission_add(struct request_t *r)
+{
+    struct client_t *c = r->client;
+
+    request_list_append(&c->queued, r);
+    if (c->queued.len == 1)
+        client_append(&admission_round, c);
+    admission_len++;
+}
+
+static void admission_remove(struct request_t *r)
+{
+    struct client_t *c = r->client;
+
+    request_list_remove(r);
+    if (c->queued.len == 0)
+        client_unlink(c);
+    admission_len--;
+}
+
+/* Number of requests queued on or sent to p */
+static int peer_load(struct peer_t *p)
+{
+    return p->pending.len + p->sent.len;
+}
+
+/* Returns 1 if p is one of the min_warm connections to be kept open: the
+   other ones up or on their way, but not draining, are fewer. */
+static int peer_warm(const struct peer_t *p)
+{
+    int live = 0;
+    int i;
+
+    for (i = 0; i < num_peers; i++) {
+        if (&peers[i] != p && peers[i].con != DEAD && !peers[i].draining)
+            live++;
     }
+    return live < min_warm;
+}
+
+/* Starts the idle timer of a connection that has nothing left to do: a
+   draining one is closed right away, a warm one gets a probe in a while,
+   any other is closed in a while, see peer_expired(). */
+static void peer_idle_check(struct peer_t *p)
+{
+    unsigned long long delay = PEER_IDLE_TIMEOUT * 1000ULL;
+
+    if (p->con != CONNECTED || peer_load(p) != 0)
+        return;
+    if (p->draining)
+        delay = 0;
+    else if (peer_warm(p))
+        delay = PEER_KEEPALIVE * 1000ULL;
+    timeout_set(&p->timer, now_ms() + delay);
+}
+
+/* Puts the client connection c back on the free list. */
+static void tcp_client_free(struct tcp_client_t *c)
+{
+    c->next = free_tcp_clients;
+    free_tcp_clients = c;
+}
+
+/* Closes the connection of c. Answers to its requests still in flight are
+   dropped as they come in, and the slot is free once they all did. */
+static void tcp_client_close(struct tcp_client_t *c, const char *why)
+{
+    if (c->fd < 0)
+        return;
+    printf("closing TCP client %s:%d: %s\n", inet_ntoa(c->a.sin_addr), ntohs(c->a.sin_port), why);
+    close(c->fd);
+    c->fd = -1;
+    c->bl = 0;
+    c->paused = c->eof = 0;
+    free(c->ob);
+    c->ob = NULL;
+    c->ob_pos = c->ob_len = c->ob_size = 0;
+    timeout_cancel(&c->timer);
+    tcp_open--;
+    if (c->held) {
+        struct tcp_client_t **pp;
+
+        // tcp_clients_unhold() may have taken the list already
+        for (pp = &held_tcp_clients; *pp != NULL && *pp != c; pp = &(*pp)->hnext);
+        if (*pp != NULL)
+            *pp = c->hnext;
+        c->held = 0;
+    }
+    if (c->inflight == 0 && !c->resume)
+        tcp_client_free(c);
+}
+
+/* Writes what is waiting in the output buffer of c. Returns 0 if the
+   connection broke. */
+static int tcp_client_flush(struct tcp_client_t *c)
+{
+    int ret;
+
+    while (c->ob_pos < c->ob_len) {
+        ret = write(c->fd, c->ob + c->ob_pos, c->ob_len - c->ob_pos);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return 1;
+        if (ret <= 0)
+            return 0;
+        c->ob_pos += ret;
+        timeout_set(&c->timer, now_ms() + tcp_idle * 1000ULL);
+    }
+    c->ob_pos = c->ob_len = 0;
+    return 1;
+}
+
+/* Sends the answer m of len bytes to c with its length prefix, straight to
+   the socket unless answers are waiting already; what the socket doesn't
+   take is buffered until EPOLLOUT. A client that lets more than
+   TCP_CLIENT_OBUF_MAX bytes pile up is cut off. */
+static void tcp_client_send(struct tcp_client_t *c, const unsigned char *m, int len)
+{
+    unsigned char prefix[2];
+    struct iovec iov[2];
+    unsigned char *ob;
+    int done = 0;
+    int size;
+    int ret;
+
+    if (c->fd < 0)
+        return;
+    prefix[0] = len >> 8;
+    prefix[1] = len;
+    if (c->ob_len == 0) {
+        iov[0].iov_base = prefix;
+        iov[0].iov_len = 2;
+        iov[1].iov_base = (void*)m;
+        iov[1].iov_len = len;
+        while ((ret = writev(c->fd, iov, 2)) < 0 && errno == EINTR);
+        if (ret < 0 && errno != EAGAIN) {
+            tcp_client_close(c, strerror(errno));
+            return;
+        }
+        if (ret > 0) {
+            done = ret;
+            timeout_set(&c->timer, now_ms() + tcp_idle * 1000ULL);
+        }
+        if (done == len + 2)
+            return;
+    }
+
+    if (c->ob_len + len + 2 - done > c->ob_size && c->ob_pos > 0) {
+        memmove(c->ob, c->ob + c->ob_pos, c->ob_len - c->ob_pos);
+        c->ob_len -= c->ob_pos;
+        c->ob_pos = 0;
+    }
+    if (c->ob_len + len + 2 - done > c->ob_size) {
+        if (c->ob_len + len + 2 - done > TCP_CLIENT_OBUF_MAX) {
+            tcp_client_close(c, "answers not read");
+            return;
+        }
+        for (size = c->ob_size > 0 ? c->ob_size : 4096; size < c->ob_len + len + 2 - done; size <<= 1);
+        if (size > TCP_CLIENT_OBUF_MAX)
+            size = TCP_CLIENT_OBUF_MAX;
+        if ((ob = realloc(c->ob, size)) == NULL) {
+            tcp_client_close(c, "out of memory");
+            return;
+        }
+        c->ob = ob;
+        c->ob_size = size;
+    }
+    if (done < 2) {
+        memcpy(c->ob + c->ob_len, prefix + done, 2 - done);
+        c->ob_len += 2 - done;
+        done = 2;
+    }
+    memcpy(c->ob + c->ob_len, m + done - 2, len + 2 - done);
+    c->ob_len += len + 2 - done;
+}
+
+/* A request of c left the table: c may take more queries now, or close if
+   the client is done sending, see tcp_clients_resume(). */
+static void tcp_client_done(struct tcp_client_t *c)
+{
+    c->inflight--;
+    if (c->resume)
+        return;
+    if (c->fd < 0) {
+        if (c->inflight == 0)
+            tcp_client_free(c);
+        return;
+    }
+    if (c->paused || c->eof) {
+        c->resume = 1;
+        c->next = resume_tcp_clients;
+        resume_tcp_clients = c;
+    }
+}
+
+/* Sets the epoll events of c: EPOLLIN and EPOLLRDHUP only if it's read. */
+static void tcp_client_watch(struct tcp_client_t *c, int read)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT|EPOLLET | (read ? EPOLLIN|EPOLLRDHUP : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        perror("epoll_ctl on TCP client");
+}
+
+/* Stops reading c while the admission queue is full, as udp_readreqs()
+   does with the UDP socket, so that the kernel's buffers and TCP's flow
+   control hold the client back; see tcp_clients_unhold(). */
+static void tcp_client_hold(struct tcp_client_t *c)
+{
+    if (c->held)
+        return;
+    c->held = 1;
+    c->hnext = held_tcp_clients;
+    held_tcp_clients = c;
+    tcp_holds++;
+    tcp_client_watch(c, 0);
+}
+
+static void tcp_client_read(struct tcp_client_t *c);
+
+/* Reads the held connections again once the admission queue has room.
+   One that fills it again goes back on the list. */
+static void tcp_clients_unhold(void)
+{
+    struct tcp_client_t *c, *list = held_tcp_clients;
+
+    held_tcp_clients = NULL;
+    while ((c = list) != NULL) {
+        list = c->hnext;
+        // closed meanwhile
+        if (!c->held)
+            continue;
+        c->held = 0;
+        tcp_client_watch(c, 1);
+        tcp_client_read(c);
+    }
+}
+
+/* Frees the request slot and takes the request off its peer's queues. */
+static void request_done(struct request_t *r)
+{
+    struct request_t *w;
+    struct peer_t *p = r->peer;
+
+    // coalesced requests share the fate of the one they wait on
+    while ((w = r->waiters) != NULL) {
+        r->waiters = w->qnext;
+        request_done(w);
+    }
+    // and the other copy of a hedged request is of no use anymore
+    if ((w = r->twin) != NULL) {
+        r->twin = w->twin = NULL;
+        request_done(w);
+    }
+    if (r->active != COALESCED)
+        question_remove(r);
+    timeout_cancel(&r->deadline);
+    timeout_cancel(&r->hedge_at);
+    timeout_cancel(&r->stale_at);
+    if (r->active == QUEUED)
+        admission_remove(r);
+    request_list_remove(r);
+    if (r->client != NULL && --r->client->inflight == 0 && r->client != &local_client)
+        client_append(&idle_clients, r->client);
+    r->client = NULL;
+    if (r->tcp != NULL)
+        tcp_client_done(r->tcp);
+    r->tcp = NULL;
+    request_index_remove(r);
+    if (p != NULL)
+        peer_id_free(p, r->id);
+    while (r->num_earlier > 0) {
+        r->num_earlier--;
+        peer_id_free(r->earlier[r->num_earlier].peer, r->earlier[r->num_earlier].id);
+    }
+    r->peer = NULL;
+    r->id = 0;
+    r->active = UNUSED;
+    r->next = free_requests;
+    free_requests = r;
+    if (p != NULL)
+        peer_idle_check(p);
+}
+
+/* Drops the hedge copies and probes queued on or sent to a peer that died;
+   the originals are still on their way and the probes were for this very
+   connection, so they aren't worth a new one. */
+static void peer_drop_hedges(struct peer_t *p)
+{
+    struct request_list_t *lists[2];
+    struct request_t *r, *next;
+    int i;
+
+    lists[0] = &p->sent;
+    lists[1] = &p->pending;
+    for (i = 0; i < 2; i++) {
+        for (r = lists[i]->head; r != NULL; r = next) {
+            next = r->next;
+            if (r->probe) {
+                request_done(r);
+            } else if (r->hedge) {
+                r->twin->twin = NULL;
+                r->twin = NULL;
+                request_done(r);
+            }
+        }
+    }
+}
+
+static void udp_release(void);
+
+/* Requests that were sent over a dead connection will never be answered
+   on it, so they go back in front of the pending queue and get resent on
+   reconnect. */
+static void peer_mark_as_dead(struct peer_t *p)
+{
+    struct request_t *r;
+
+    udp_release();
+    close(p->tcp_fd);
+    p->tcp_fd = -1;
+    timeout_cancel(&p->timer);
+    timeout_cancel(&p->rotate);
+    p->draining = 0;
+    // only the proxy knows the nameserver before CONNECT, so only then it's blamed
+    if (p->con == SOCKS_REPLY)
+        ns_failed(p);
+    p->con = DEAD;
+    p->bl = p->rpos = 0;
+    p->ob_head = p->ob_len = 0;
+    printf("peer %s got disconnected\n", peer_display(p));
+
+    peer_drop_hedges(p);
+    if (p->sent.head == NULL)
+        return;
+    for (r = p->sent.head; r != NULL; r = r->next) {
+        r->active = WAITING;
+        r->list = &p->pending;
+    }
+    p->sent.tail->next = p->pending.head;
+    if (p->pending.head)
+        p->pending.head->prev = p->sent.tail;
+    else
+        p->pending.tail = p->sent.tail;
+    p->pending.head = p->sent.head;
+    p->pending.len += p->sent.len;
+    memset(&p->sent, 0, sizeof(p->sent));
+}
+
+/* Appends r to the peer's output ring and moves it from the pending queue
+   to the sent list. peer_flush() writes the ring out at the end of the loop
+   iteration, so a burst of queries goes out in one writev(). Returns 1 upon
+   queued request and 0 if the ring is full. */
+int peer_sendreq(struct peer_t *p, struct request_t *r)
+{
+    unsigned int len = r->bl + 2;
+    unsigned int tail, first;
+
+    if (PEER_OBUF_SIZE - p->ob_len < len)
+        return 0;
+
+    tail = (p->ob_head + p->ob_len) % PEER_OBUF_SIZE;
+    first = (len < PEER_OBUF_SIZE - tail) ? len : PEER_OBUF_SIZE - tail;
+    memcpy(p->ob + tail, r->b, first);
+    memcpy(p->ob, r->b + first, len - first);
+    p->ob_len += len;
+
+    if (!p->dirty) {
+        p->dirty = 1;
+        dirty_peers[num_dirty++] = p;
+    }
+
+    request_list_remove(r);
+    request_list_append(&p->sent, r);
+    r->active = SENT;
+    r->sent_ms = now_ms();
+    timeout_set(&r->deadline, r->sent_ms + ns_rto(p->nsi));
+    return 1;
+}
+
+/* Writes as much of the output ring as the socket takes; if it takes less,
+   EPOLLOUT tells us when to go on. Returns 1 on success, 0 if the peer got
+   disconnected. */
+static int peer_flush(struct peer_t *p)
+{
+    struct iovec iov[2];
+    unsigned int first;
+    int ret, err;
+
+    while (p->ob_len > 0) {
+        first = PEER_OBUF_SIZE - p->ob_head;
+        if (first > p->ob_len)
+            first = p->ob_len;
+        iov[0].iov_base = p->ob + p->ob_head;
+        iov[0].iov_len = first;
+        iov[1].iov_base = p->ob;
+        iov[1].iov_len = p->ob_len - first;
+
+        /* This is writing data to the remote DNS server over Tor with TCP */
+        ret = writev(p->tcp_fd, iov, iov[1].iov_len ? 2 : 1);
+        // printing to a full log pipe may clobber errno
+        err = errno;
+        printf("peer_flush writev attempt returned: %d\n", ret);
+        if (ret < 0 && err == EINTR)
+            continue;
+        if (ret < 0 && err == EAGAIN)
+            return 1;
+        if (ret <= 0) {
+            peer_mark_as_dead(p);
+            return 0;
+        }
+        p->ob_head = (p->ob_head + ret) % PEER_OBUF_SIZE;
+        p->ob_len -= ret;
+    }
+    p->ob_head = 0;
+    return 1;
+}
+
+/* Flushes the output of every peer that got some this loop iteration. */
+static void peers_flush(void)
+{
+    int i;
+
+    for (i = 0; i < num_dirty; i++) {
+        struct peer_t *p = dirty_peers[i];
+
+        p->dirty = 0;
+        if (p->con == CONNECTED)
+            peer_flush(p);
+    }
+    num_dirty = 0;
+}
+
+/* Sets up udp_batch receive slots and a send queue of as many answers.
+   Returns 1 on success, 0 if out of memory. */
+static int udp_init(void)
+{
+    int i;
+
+    udp_in = calloc(udp_batch, sizeof(*udp_in));
+    udp_in_iov = calloc(udp_batch, sizeof(*udp_in_iov));
+    udp_in_msgs = calloc(udp_batch, sizeof(*udp_in_msgs));
+    udp_out_addr = calloc(udp_batch, sizeof(*udp_out_addr));
+    udp_out_iov = calloc(udp_batch, sizeof(*udp_out_iov));
+    udp_out_msgs = calloc(udp_batch, sizeof(*udp_out_msgs));
+    // room for a batch of typical answers, but always for the largest one
+    udp_out_size = udp_batch * RECV_BUF_SIZE;
+    if (udp_out_size < DNS_MAX_MSG)
+        udp_out_size = DNS_MAX_MSG;
+    udp_out_buf = malloc(udp_out_size);
+    udp_spill = malloc(DNS_MAX_MSG);
+    if (!udp_in || !udp_in_iov || !udp_in_msgs || !udp_out_addr || !udp_out_iov
+        || !udp_out_msgs || !udp_out_buf || !udp_spill)
+        return 0;
+
+    for (i = 0; i < udp_batch; i++) {
+        udp_in_iov[i].iov_base = udp_in[i].b + 2;
+        udp_in_iov[i].iov_len = RECV_BUF_SIZE - 2;
+        udp_in_msgs[i].msg_hdr.msg_name = &udp_in[i].a;
+        udp_in_msgs[i].msg_hdr.msg_iov = &udp_in_iov[i];
+        udp_in_msgs[i].msg_hdr.msg_iovlen = 1;
+        udp_out_msgs[i].msg_hdr.msg_name = &udp_out_addr[i];
+        udp_out_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        udp_out_msgs[i].msg_hdr.msg_iov = &udp_out_iov[i];
+        udp_out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    udp_out_len = udp_out_sent = udp_out_refs = udp_out_used = 0;
+    return 1;
+}
+
+/* Lets the event loop tell us when udp_fd takes datagrams again, or stops
+   it from doing so. */
+static void udp_wait_writable(int on)
+{
+    struct epoll_event ev;
+
+    udp_blocked = on;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLET|(on ? EPOLLOUT : 0);
+    ev.data.ptr = &udp_ev;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, udp_fd, &ev) < 0)
+        perror("epoll_ctl on UDP fd");
+}
+
+/* Moves the answers the socket didn't take to the front of the queue.
+   Those still in a peer's receive buffer, which they mustn't outlive, are
+   copied into udp_out_buf; if there's no room left, they're dropped. */
+static void udp_keep(void)
+{
+    unsigned char *m;
+    int len;
+    int i, n = 0;
+
+    for (i = udp_out_sent; i < udp_out_len; i++) {
+        m = udp_out_iov[i].iov_base;
+        len = udp_out_iov[i].iov_len;
+        if (udp_out_refs > 0 && (m < udp_out_buf || m >= udp_out_buf + udp_out_size)) {
+            if (udp_out_used + len > udp_out_size) {
+                udp_dropped++;
+                continue;
+            }
+            memcpy(udp_out_buf + udp_out_used, m, len);
+            udp_out_iov[i].iov_base = udp_out_buf + udp_out_used;
+            udp_out_used += len;
+        }
+        udp_out_addr[n] = udp_out_addr[i];
+        udp_out_iov[n] = udp_out_iov[i];
+        n++;
+    }
+    udp_out_len = n;
+    udp_out_sent = udp_out_refs = 0;
+}
+
+/* Sends the queued answers with sendmmsg(). What a full socket buffer
+   doesn't take waits for EPOLLOUT, see udp_writable(), and answers that
+   come in meanwhile queue up behind it as far as there's room. */
+static void udp_flush(void)
+{
+    int ret;
+
+    while (!udp_blocked && udp_out_sent < udp_out_len) {
+        ret = sendmmsg(udp_fd, udp_out_msgs + udp_out_sent, udp_out_len - udp_out_sent, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN) {
+            udp_blocks++;
+            udp_wait_writable(1);
+            break;
+        }
+        if (ret < 0) {
+            // only the first datagram failed, skip it and go on
+            perror("sendmmsg on UDP fd");
+            udp_out_sent++;
+            continue;
+        }
+        udp_tx_batches++;
+        udp_tx_msgs += ret;
+        if (ret == udp_batch)
+            udp_tx_full++;
+        udp_out_sent += ret;
+    }
+    if (udp_out_sent == udp_out_len) {
+        udp_out_len = udp_out_sent = udp_out_refs = udp_out_used = 0;
+        return;
+    }
+    udp_keep();
+}
+
+/* udp_fd has room again for the answers that waited. */
+static void udp_writable(void)
+{
+    udp_wait_writable(0);
+    udp_flush();
+}
+
+/* Returns where to write an answer of len bytes (at most DNS_MAX_MSG) in
+   the send queue, flushing the queue first if it's full. The answer is
+   queued by answer_commit(). While the socket is full and so is the
+   queue, that's udp_spill, and a datagram written there is dropped. */
+static unsigned char *udp_answer_reserve(int len)
+{
+    if (udp_out_len == udp_batch || udp_out_used + len > udp_out_size)
+        udp_flush();
+    if (udp_out_len == udp_batch || udp_out_used + len > udp_out_size)
+        udp_out_next = udp_spill;
+    else
+        udp_out_next = udp_out_buf + udp_out_used;
+    return udp_out_next;
+}
+
+/* Queues the datagram m of len bytes for the client a. */
+static void udp_queue(const struct sockaddr_in *a, unsigned char *m, int len)
+{
+    udp_out_addr[udp_out_len] = *a;
+    udp_out_addr[udp_out_len].sin_family = AF_INET;
+    udp_out_iov[udp_out_len].iov_base = m;
+    udp_out_iov[udp_out_len].iov_len = len;
+    udp_out_len++;
+}
+
+/* Queues the len bytes written at udp_answer_reserve() for the client a. */
+static void udp_answer_commit(const struct sockaddr_in *a, int len)
+{
+    if (udp_out_next == udp_spill) {
+        udp_dropped++;
+        return;
+    }
+    udp_queue(a, udp_out_next, len);
+    udp_out_used += len;
+}
+
+/* Cuts the answer m of len bytes down to the question with TC set if it's
+   more than the client of q takes over UDP. Without a TCP listener to ask
+   again on, it goes whole as it always did. Returns the length to send. */
+static int udp_fit(const struct request_t *q, unsigned char *m, int len)
+{
+    if (tcp_listen_fd >= 0 && len > dns_udp_size(q->b + 2, q->bl)) {
+        len = dns_truncate(m, len);
+        udp_truncated++;
+    }
+    return len;
+}
+
+/* Sends the len bytes written at udp_answer_reserve() to the client of q:
+   over the connection q came by, or as a datagram, see udp_fit(). */
+static void answer_commit(const struct request_t *q, int len)
+{
+    unsigned char *m = udp_out_next;
+
+    if (q->tcp != NULL) {
+        tcp_client_send(q->tcp, m, len);
+        return;
+    }
+    udp_answer_commit(&q->a, udp_fit(q, m, len));
+}
+
+/* Sends the answer m of len bytes, which is in the receive buffer of a
+   peer, to the client of q like answer_commit() but without copying it:
+   the datagram points into that buffer, see udp_release(). m may be cut
+   down in place, so other clients have to get theirs first. */
+static void answer_forward(const struct request_t *q, unsigned char *m, int len)
+{
+    if (q->tcp != NULL) {
+        tcp_client_send(q->tcp, m, len);
+        return;
+    }
+    if (udp_out_len == udp_batch)
+        udp_flush();
+    if (udp_out_len == udp_batch) {
+        udp_dropped++;
+        return;
+    }
+    udp_queue(&q->a, m, udp_fit(q, m, len));
+    udp_out_refs++;
+}
+
+/* A peer's receive buffer is about to be reused: the answers queued
+   straight from it go out now, or get copied, see udp_keep(). */
+static void udp_release(void)
+{
+    if (udp_out_refs > 0)
+        udp_flush();
+}
+
+/* Answers the client of q with an error of rcode and no records. */
+static void udp_error_reply(const struct request_t *q, int rcode)
+{
+    unsigned char *m;
+    int len;
+
+    if (q->answered)
+        return;
+    m = udp_answer_reserve(q->bl);
+    if ((len = dns_error_reply(q->b + 2, q->bl, rcode, m)) < 0)
+        return;
+    // the id in b is the upstream one
+    m[0] = q->rid >> 8;
+    m[1] = q->rid;
+    answer_commit(q, len);
+}
+
+/* Caches the answer m to request r if its question is the one r asked. */
+static void cache_answer_store(struct request_t *r, unsigned char *m, int len)
+{
+    struct dns_key_t ak;
+
+    if (r->qend < 0)
+        return;
+    // the DO bit is the last key byte and is keyed from the request only
+    if (dns_question_key(m, len, &ak) < 0 || ak.kl != r->key.kl
+        || memcmp(ak.k, r->key.k, r->key.kl - 1) != 0) {
+        printf("answer doesn't match the question asked, not caching it\n");
+        return;
+    }
+    cache_store(&r->key, m, len, dns_min_ttl(m, len), time(NULL));
+}
+
+/* Queues the answer m to the question of request q for q's client, with
+   the client's id, RD flag and question (with its 0x20 casing) and the
+   TTLs aged by age seconds, or all STALE_TTL if stale is set. Returns 0 if
+   m isn't shaped like an answer to q's question. */
+static int udp_answer_as(const struct request_t *q, const unsigned char *m, int len,
+                         unsigned int age, int stale)
+{
+    const unsigned char *qm = q->b + 2;
+    unsigned char *ans;
+
+    if (q->answered)
+        return 1;
+    if (q->qend < 0 || len > DNS_MAX_MSG || dns_skip_name(m, len, DNS_HEADER_SIZE) + 4 != q->qend)
+        return 0;
+
+    ans = udp_answer_reserve(len);
+    memcpy(ans, m, len);
+    // the id in b is the upstream one once q was sent
+    ans[0] = q->rid >> 8;
+    ans[1] = q->rid;
+    ans[2] = (ans[2] & 0xfe) | (qm[2] & 0x01);
+    memcpy(ans + DNS_HEADER_SIZE, qm + DNS_HEADER_SIZE, q->qend - DNS_HEADER_SIZE);
+    if (stale)
+        dns_set_ttls(ans, len, STALE_TTL);
+    else
+        dns_age_ttls(ans, len, age);
+    answer_commit(q, len);
+    return 1;
+}
+
+/* Answers the client of r from the cache even if the answer expired, as
+   long as it's within the stale window. Returns 1 if it was answered. */
+static int request_serve_stale(const struct request_t *r)
+{
+    struct cache_entry_t *e;
+    time_t now = time(NULL);
+
+    if (r->answered || r->qend < 0 || (e = cache_lookup_stale(&r->key, now)) == NULL)
+        return 0;
+    if (!udp_answer_as(r, e->b, e->bl, now - e->stored, e->expire <= now))
+        return 0;
+    printf("answering id=%d from cache, %ld s stale\n", r->rid,
+           e->expire <= now ? (long)(now - e->expire) : 0L);
+    return 1;
+}
+
+/* Answers the client of r with rcode, or with a stale answer if there's one:
+   an old answer beats none, see RFC 8767. */
+static void request_fail(const struct request_t *r, int rcode)
+{
+    if (request_serve_stale(r))
+        stale_rescues++;
+    else
+        udp_error_reply(r, rcode);
+}
+
+/* Asks the upstream once more for the question of tmp, whose cached answer
+   is about to expire, with no client waiting: the answer just goes into the
+   cache. Requests that come in meanwhile wait for it. Left out when the
+   daemon is busy. */
+static void request_prefetch(const struct request_t *tmp)
+{
+    static __thread unsigned short seq;
+    struct request_t r;
+
+    if (free_requests == NULL || admission_len > 0)
+        return;
+    memcpy(&r, tmp, sizeof(r));
+    memset(&r.a, 0, sizeof(r.a));
+    r.tcp = NULL;
+    r.rid = ++seq;
+    r.answered = 1;
+    if (request_add(&r))
+        prefetches++;
+}
+
+/* Returns 1 if the request was answered from the cache, 0 otherwise. An
+   answer asked for often that expires within refresh_ahead seconds is
+   fetched again on the way. */
+static int cache_answer_request(struct request_t *tmp)
+{
+    struct cache_entry_t *e;
+    time_t now = time(NULL);
+
+    if (tmp->qend < 0)
+        return 0;
+    if ((e = cache_lookup(&tmp->key, now)) == NULL)
+        return 0;
+    if (!udp_answer_as(tmp, e->b, e->bl, now - e->stored, 0))
+        return 0;
+
+    printf("answering id=%d from cache (%d bytes)\n", tmp->rid, e->bl);
+    // answers shorter lived than the window would be fetched on every hit
+    if (refresh_ahead > 0 && e->hits >= REFRESH_MIN_HITS
+        && e->expire - now <= (time_t)refresh_ahead && e->expire - e->stored > (time_t)refresh_ahead
+        && question_find(tmp) == NULL)
+        request_prefetch(tmp);
+    return 1;
+}
+
+/* Takes the latency of an answer for the hedge delay. */
+static void rtt_record(unsigned long long ms)
+{
+    rtt_samples[rtt_count++ % RTT_SAMPLES] = ms > UINT_MAX ? UINT_MAX : ms;
+    rtt_fresh = 1;
+}
+
+/* Forwards every complete answer in the peer's receive buffer to its
+   client. Answers are parsed and patched where they are; the read cursor
+   just moves past them and a partial one stays where it is. */
+static void peer_process_answers(struct peer_t *p)
+{
+    struct request_t *r, *w;
+    unsigned long long sent_ms;
+    unsigned char *m;
+    int id;
+    int len;
+    int i;
+
+    while (p->bl - p->rpos >= 2) {
+        len = (p->b[p->rpos] << 8) | p->b[p->rpos + 1];
+
+        printf("r l=%d r=%d\n", len, p->bl - p->rpos - 2);
+
+        if (p->rpos + 2 + len > p->bl)
+            break;
+        m = p->b + p->rpos + 2;
+        p->rpos += 2 + len;
+
+        printf("received answer %d bytes\n", len);
+        if (len < DNS_HEADER_SIZE)
+            continue;
+
+        id = (m[0] << 8) | m[1];
+        if ((r = p->inflight[id]) == NULL) {
+            printf("can't find id=%d\n", id);
+            continue;
+        }
+        // a probe has no client, it just kept the connection busy
+        if (r->probe) {
+            ns_answered(p, r->sent_ms);
+            request_done(r);
+            continue;
+        }
+        // the answer to an earlier try may still beat the current one
+        sent_ms = r->sent_ms;
+        if (r->peer != p || r->id != (uint)id) {
+            for (i = 0; i < r->num_earlier; i++) {
+                if (r->earlier[i].peer == p && r->earlier[i].id == (uint)id)
+                    sent_ms = r->earlier[i].sent_ms;
+            }
+            printf("answer to an earlier try of id=%d\n", r->rid);
+        }
+        // the hedge copy won, answer as the original
+        if (r->hedge) {
+            r = r->twin;
+            hedges_won++;
+        }
+        rtt_record(now_ms() - r->start_ms);
+        ns_answered(p, sent_ms);
+
+        // write back real id
+        m[0] = r->rid >> 8;
+        m[1] = r->rid;
+
+        // Remove the AD flag from the reply if it has one. Because we might be
+        // answering requests to 127.0.0.1, the client might consider us
+        // trusted. While trusted, we shouldn't indicate that data is DNSSEC
+        // valid when we haven't checked it.
+        // See http://tools.ietf.org/html/rfc2535#section-6.1
+        m[3] &= 0xdf;
+
+        cache_answer_store(r, m, len);
+
+        // the clients of identical requests get it as well, with their ids
+        for (w = r->waiters; w != NULL; w = w->qnext) {
+            if (!udp_answer_as(w, m, len, 0, 0))
+                printf("answer doesn't fit the coalesced request id=%d\n", w->rid);
+        }
+
+        /* This is where we queue the answer over UDP to the client, right
+           from the receive buffer */
+        if (!r->answered)
+            answer_forward(r, m, len);
+
+        printf("forwarding answer (%d bytes)\n", len);
+
+        // mark as handled/unused
+        p->answered++;
+        request_done(r);
+    }
+
+    // an empty buffer rewinds for free, once no datagram points into it
+    if (p->rpos == p->bl && udp_out_refs == 0)
+        p->rpos = p->bl = 0;
+}
+
+/* Makes room at the end of the receive buffer: a partial answer is moved to
+   the front once the buffer end is reached, and the buffer doubles (up to
+   the largest possible DNS over TCP message) when that answer fills it
+   completely. Returns 1 on success, 0 if out of memory. */
+static int peer_rbuf_reserve(struct peer_t *p)
+{
+    unsigned char *nb;
+    int nsize;
+
+    if (p->bl < p->bsize)
+        return 1;
+    udp_release();
+    if (p->rpos > 0) {
+        memmove(p->b, p->b + p->rpos, p->bl - p->rpos);
+        p->bl -= p->rpos;
+        p->rpos = 0;
+        return 1;
+    }
+    nsize = (p->bsize * 2 < PEER_RBUF_MAX) ? p->bsize * 2 : PEER_RBUF_MAX;
+    if (nsize <= p->bsize || !(nb = realloc(p->b, nsize)))
+        return 0;
+    p->b = nb;
+    p->bsize = nsize;
+    return 1;
+}
+
+/* Reads until the socket is drained, as edge-triggered epoll only reports
+   new data once. Returns 1 once drained and 3 on disconnect. */
+int peer_readres(struct peer_t *p)
+{
+    int ret, err;
+
+    for (;;) {
+        if (!peer_rbuf_reserve(p)) {
+            printf("can't grow the receive buffer of %s\n", peer_display(p));
+            peer_mark_as_dead(p);
+            return 3;
+        }
+        /* This is reading data from Tor over TCP */
+        ret = read(p->tcp_fd, p->b + p->bl, p->bsize - p->bl);
+        // printing to a full log pipe may clobber errno
+        err = errno;
+        printf("peer_readres read attempt returned: %d\n", ret);
+        if (ret < 0 && err == EINTR)
+            continue;
+        if (ret < 0 && err == EAGAIN) {
+            // the answers made room in the window
+            peer_handleoutstanding(p);
+            return 1;
+        }
+        if (ret <= 0) {
+            peer_mark_as_dead(p);
+            return 3;
+        }
+        p->bl += ret;
+        peer_process_answers(p);
+    }
+}
+
+/* Sends the requests queued for this connection, oldest first, and does
+   not return anything. */
+void peer_handleoutstanding(struct peer_t *p)
+{
+    // stops when the output ring is full, EPOLLOUT brings us back, or
+    // the window is, answers bring us back
+    while (p->con == CONNECTED && p->pending.head != NULL && p->sent.len < window) {
+        if (!peer_sendreq(p, p->pending.head))
+            break;
+    }
+}
+
+/* Returns the least loaded peer. A connection that still has to be set
+   up counts as PEER_CONNECT_COST extra requests, so new connections are
+   only opened once the established ones have some backlog. Ties rotate
+   over the pool. Returns NULL if every window is full, see --window. */
+struct peer_t *peer_select(void)
+{
+    static __thread unsigned int next;
+    struct peer_t *best = NULL;
+    int best_cost = 0;
+    int i;
+
+    for (i = 0; i < num_peers; i++) {
+        struct peer_t *p = &peers[(next + i) % (unsigned int)num_peers];
+        int cost = peer_load(p);
+
+        // full ones get none, draining ones only if they're all draining
+        if (cost >= window || (p->draining && best != NULL && !best->draining))
+            continue;
+        if (p->con != CONNECTED)
+            cost += PEER_CONNECT_COST;
+        if (best == NULL || (best->draining && !p->draining) || cost < best_cost) {
+            best = p;
+            best_cost = cost;
+        }
+    }
+    next++;
+    return best;
+}
+
+/* Lower is better: the smoothed latency, inflated by the timeout and
+   connection failure rates. Nameservers without answers yet score 0, so
+   each gets tried. */
+static unsigned long long ns_score(int i)
+{
+    struct ns_stats_t *s = &ns_stats[i];
+
+    return (unsigned long long)s->srtt
+        * (1000 + NS_PENALTY * (s->timeout_rate + s->fail_rate));
+}
+
+/* Returns the best score of the nameservers with enough answers to tell,
+   0 if there's none. */
+static unsigned long long ns_best_score(void)
+{
+    unsigned long long best = 0;
+    int i;
+
+    for (i = 0; i < (int)num_nameservers; i++) {
+        if (ns_stats[i].answers >= RTT_MIN_SAMPLES && ns_stats[i].backoff_until <= time(NULL)
+            && (best == 0 || ns_score(i) < best))
+            best = ns_score(i);
+    }
+    return best;
+}
+
+/* Picks a nameserver by the power of two choices: of two random ones that
+   aren't backed off and not in the exclude mask, the one that scores
+   better. Returns the number, -1 if there's no candidate. */
+static int ns_pick(unsigned int exclude)
+{
+    int candidates[MAX_NAMESERVERS];
+    int n = 0;
+    int a, b;
+    int i;
+    time_t now = time(NULL);
+
+    for (i = 0; i < (int)num_nameservers; i++) {
+        if (ns_stats[i].backoff_until <= now && !(exclude & (1U << i)))
+            candidates[n++] = i;
+    }
+    if (n == 0)
+        return -1;
+
+    // This could use a real bit of randomness, I suspect
+    a = candidates[(rand()>>16) % n];
+    b = candidates[(rand()>>16) % n];
+    return ns_score(b) < ns_score(a) ? b : a;
+}
+
+/* Picks a nameserver for a new connection, see ns_pick(). If all of them
+   are backed off, it's the one that gets out of it first. Returns the
+   number. */
+int ns_select(void)
+{
+    int a, i;
+
+    if ((a = ns_pick(0)) >= 0)
+        return a;
+    for (i = 1, a = 0; i < (int)num_nameservers; i++) {
+        if (ns_stats[i].backoff_until < ns_stats[a].backoff_until)
+            a = i;
+    }
+    return a;
+}
+
+/* Connects the dead peer p for the requests queued on it and races up to
+   race - 1 more handshakes to other nameservers over idle dead peers
+   against it; the first one through takes the queue, see peer_race_won().
+   Returns 0 if p can't even start connecting. */
+static int peer_race(struct peer_t *p)
+{
+    unsigned int used;
+    int started = 0;
+    int i, nsi;
+
+    if (p->con != DEAD)
+        return 1;
+    nsi = ns_select();
+    if (!peer_connect(p, nsi))
+        return 0;
+    used = 1U << nsi;
+    for (i = 0; i < num_peers && started < race - 1; i++) {
+        struct peer_t *q = &peers[i];
+
+        if (q->con != DEAD || q->pending.len > 0)
+            continue;
+        if ((nsi = ns_pick(used)) < 0)
+            break;
+        if (!peer_connect(q, nsi))
+            break;
+        used |= 1U << nsi;
+        // 0 means no race
+        if (started++ == 0 && ++race_seq == 0)
+            race_seq = 1;
+        q->race = race_seq;
+    }
+    if (started > 0) {
+        p->race = race_seq;
+        races++;
+        printf("racing %d connections for %d requests\n", started + 1, p->pending.len);
+    }
+    return 1;
+}
+
+/* Takes r off the peer it's on. If r was sent already, its id stays mapped
+   until r is done, so that a slow answer to it is still taken; otherwise
+   the id is freed. */
+static void request_unassign(struct request_t *r)
+{
+    request_list_remove(r);
+    if (r->peer != NULL && r->active == SENT && r->num_earlier < MAX_TRIES) {
+        r->earlier[r->num_earlier].peer = r->peer;
+        r->earlier[r->num_earlier].id = r->id;
+        r->earlier[r->num_earlier].sent_ms = r->sent_ms;
+        r->num_earlier++;
+    } else if (r->peer != NULL) {
+        peer_id_free(r->peer, r->id);
+    }
+    r->peer = NULL;
+    r->id = 0;
+}
+
+/* Queues r on p instead of the peer it's on, with an upstream id of p's,
+   see request_unassign(). Returns 0 if there's no id left there. */
+static int request_move(struct request_t *r, struct peer_t *p)
+{
+    unsigned short int *ul;
+    uint id;
+
+    if ((id = peer_id_alloc(p, r)) == 0)
+        return 0;
+    request_unassign(r);
+    r->id = id;
+    ul = (unsigned short int*)(r->b + 2);
+    *ul = htons(r->id);
+    r->peer = p;
+    r->active = WAITING;
+    request_list_append(&p->pending, r);
+    return 1;
+}
+
+/* p got through first of the connections racing with it: the requests
+   waiting on the others move over, and those still connecting carry on as
+   members of the pool. */
+static void peer_race_won(struct peer_t *p)
+{
+    int i;
+
+    if (p->race == 0)
+        return;
+    for (i = 0; i < num_peers; i++) {
+        struct peer_t *q = &peers[i];
+
+        if (q == p || q->race != p->race)
+            continue;
+        q->race = 0;
+        if (q->con == CONNECTED)
+            continue;
+        while (q->pending.head != NULL && request_move(q->pending.head, p))
+            races_moved++;
+    }
+    p->race = 0;
+}
+
+static void request_timed_out(void *arg);
+static void request_hedge_due(void *arg);
+static void request_stale_due(void *arg);
+static int resolve_start(struct request_t *r, int type, const char *name, struct in_addr addr);
+
+/* Sets up the timers of a request slot that was just filled in by copying,
+   none of them running. */
+static void request_timers_init(struct request_t *r)
+{
+    timeout_init(&r->deadline, request_timed_out, r);
+    timeout_init(&r->hedge_at, request_hedge_due, r);
+    timeout_init(&r->stale_at, request_stale_due, r);
+}
+
+/* Takes a free slot of the request table and fills it in from r as a
+   request in state active: on no list, peer or timer yet, with no upstream
+   id, waiters or hedge copy. Returns NULL if the table is full. */
+static struct request_t *request_slot_take(const struct request_t *r, REQ_STATE active)
+{
+    struct request_t *q = free_requests;
+
+    if (q == NULL)
+        return NULL;
+    free_requests = q->next;
+    memcpy(q, r, sizeof(*q));
+    q->list = NULL;
+    q->prev = q->next = NULL;
+    q->peer = NULL;
+    q->id = 0;
+    q->active = active;
+    q->waiters = NULL;
+    q->twin = NULL;
+    q->hedge = 0;
+    q->num_earlier = 0;
+    request_timers_init(q);
+    return q;
+}
+
+/* The upstream took stale_deadline ms for r: its client gets the expired
+   answer from the cache, and the real one only goes into the cache. */
+static void request_stale_due(void *arg)
+{
+    struct request_t *r = arg;
+
+    if (request_serve_stale(r)) {
+        r->answered = 1;
+        stale_served++;
+    }
+}
+
+/* Arms the stale deadline of r, just come in, if there's an expired answer
+   to serve. */
+static void request_stale_arm(struct request_t *r)
+{
+    if (stale_window > 0 && !r->answered && r->qend >= 0
+        && cache_lookup_stale(&r->key, time(NULL)) != NULL)
+        timeout_set(&r->stale_at, now_ms() + stale_deadline);
+}
+
+/* Sends a query for the root SOA over the idle connection p, so that
+   neither Tor nor the resolver lets it time out, and a connection that
+   died quietly is noticed by the probe's deadline. */
+static void peer_probe(struct peer_t *p)
+{
+    struct request_t *r = free_requests;
+    unsigned char *m;
+    uint id;
+
+    if (r == NULL || (id = peer_id_alloc(p, r)) == 0)
+        return;
+    free_requests = r->next;
+
+    memset(r, 0, sizeof(*r));
+    r->bl = DNS_HEADER_SIZE + 5;
+    r->b[1] = r->bl;
+    m = r->b + 2;
+    m[0] = id >> 8;
+    m[1] = id;
+    m[2] = 0x01; // RD
+    m[5] = 1; // one question: . SOA IN
+    m[DNS_HEADER_SIZE + 2] = DNS_TYPE_SOA;
+    m[DNS_HEADER_SIZE + 4] = DNS_CLASS_IN;
+    r->id = id;
+    r->qend = -1;
+    r->probe = 1;
+    r->peer = p;
+    r->active = WAITING;
+    r->tries = max_tries;
+    r->start_ms = now_ms();
+    request_timers_init(r);
+    request_set_deadline(r, p);
+    request_index_add(r);
+    request_list_append(&p->pending, r);
+    probes_sent++;
+    printf("probing idle connection to %s\n", peer_display(p));
+    peer_handleoutstanding(p);
+}
+
+/* The timer of p ran out: its SOCKS handshake took too long, or the
+   connection went unused for a while. */
+static void peer_expired(void *arg)
+{
+    struct peer_t *p = arg;
+
+    switch (p->con) {
+    case CONNECTING:
+    case SOCKS_METHOD:
+    case SOCKS_AUTH:
+    case SOCKS_REPLY:
+        printf("connection to %s timed out in state %d\n", peer_display(p), p->con);
+        peer_mark_as_dead(p);
+        break;
+    case CONNECTED:
+        // busy again since; the last request done starts the timer anew
+        if (peer_load(p) != 0)
+            break;
+        if (p->draining) {
+            printf("closing rotated connection to %s\n", peer_display(p));
+            peer_mark_as_dead(p);
+        } else if (peer_warm(p)) {
+            peer_probe(p);
+        } else {
+            printf("closing idle connection to %s\n", peer_display(p));
+            peer_mark_as_dead(p);
+        }
+        break;
+    case DEAD:
+    default:
+        break;
+    }
+}
+
+/* Opens connections until min_warm of them are up or on their way, not
+   counting the draining ones, so that queries don't wait for a circuit. */
+static void peers_warm(void)
+{
+    int live = 0;
+    int i;
+
+    for (i = 0; i < num_peers; i++) {
+        if (peers[i].con != DEAD && !peers[i].draining)
+            live++;
+    }
+    for (i = 0; i < num_peers && live < min_warm; i++) {
+        if (peers[i].con == DEAD && peer_connect(&peers[i], ns_select()))
+            live++;
+    }
+}
+
+/* The circuit of p gets close to Tor's dirtiness limit: p takes no new
+   requests and closes once the ones it has are answered, while another
+   connection, over a fresh circuit, takes over. Without another one, as
+   with --peers 1, p is closed and connected again in place: once it's
+   idle or, if it never is, once its circuit reaches the limit; the
+   requests it has then go out again over the new connection. */
+static void peer_rotate(void *arg)
+{
+    struct peer_t *p = arg;
+    int i;
+
+    if (p->con != CONNECTED)
+        return;
+    for (i = 0; i < num_peers; i++) {
+        if (&peers[i] != p && !peers[i].draining)
+            break;
+    }
+    if (i == num_peers) {
+        if (peer_load(p) > 0 && now_ms() - p->connected_ms < TOR_CIRCUIT_DIRTINESS * 1000ULL) {
+            timeout_set(&p->rotate, now_ms() + PEER_ROTATE_RETRY * 1000ULL);
+            return;
+        }
+        printf("reconnecting to %s, its circuit gets old\n", peer_display(p));
+        rotations++;
+        peer_mark_as_dead(p);
+        if (p->pending.len > 0)
+            peer_race(p);
+        peers_warm();
+        return;
+    }
+
+    printf("rotating connection to %s, its circuit gets old\n", peer_display(p));
+    p->draining = 1;
+    rotations++;
+    peer_idle_check(p);
+    peers_warm();
+}
+
+/* Turns r away, the daemon being overloaded: SERVFAIL or REFUSED tell the
+   client to try elsewhere now rather than after its timeout, see --shed. */
+static void request_shed(const struct request_t *r, const char *why)
+{
+    shed++;
+    printf("shedding id=%d: %s\n", r->rid, why);
+    if (shed_rcode >= 0)
+        request_fail(r, shed_rcode);
+}
+
+/* Queues r, which is in the request table already, on the peer p with an
+   upstream id of p's and sends it or gets p connected. Returns 0 if no id
+   is left there. */
+static int request_assign(struct request_t *r, struct peer_t *p)
+{
+    unsigned short int *ul;
+    unsigned int waited;
+
+    if ((r->id = peer_id_alloc(p, r)) == 0) {
+        printf("all ids of peer %s are in flight\n", peer_display(p));
+        return 0;
+    }
+    if (r->active == QUEUED) {
+        admission_remove(r);
+        waited = now_ms() - r->start_ms;
+        admitted++;
+        admission_wait += waited;
+        if (waited > admission_wait_max)
+            admission_wait_max = waited;
+    }
+
+    ul = (unsigned short int*)(r->b + 2);
+    *ul = htons(r->id);
+    printf("updating id: %d -> %d\n", r->rid, r->id);
+    r->peer = p;
+    r->active = WAITING;
+    request_set_deadline(r, p);
+    request_list_append(&p->pending, r);
+
+    // every query upstream earns hedge_budget hundredths of a hedge, see request_hedge_due()
+    if (hedge_budget > 0 && num_peers > 1)
+        timeout_set(&r->hedge_at, now_ms() + hedge_delay);
+    hedge_credit += hedge_budget;
+    if (hedge_credit > HEDGE_BURST * 100)
+        hedge_credit = HEDGE_BURST * 100;
+
+    if (p->con == CONNECTED)
+        peer_handleoutstanding(p);
+    else
+        // The request will be sent by peer_handleoutstanding when this
+        // peer's connection is established.
+        peer_race(p);
+    return 1;
+}
+
+/* Sends r upstream over the least loaded peer with room in its window or,
+   if they're all full, puts it on the admission queue. Returns 0 if the
+   queue is full as well or no upstream id is left. */
+static int request_upstream(struct request_t *r)
+{
+    struct peer_t *p = peer_select();
+
+    if (p != NULL)
+        return request_assign(r, p);
+    if (admission_len >= queue_max)
+        return 0;
+
+    // it gets its try's deadline once it's admitted
+    r->active = QUEUED;
+    admission_add(r);
+    timeout_set(&r->deadline, now_ms() + RTO_MAX_MS);
+    if (admission_len > admission_peak)
+        admission_peak = admission_len;
+    return 1;
+}
+
+/* Moves queued requests onto the peers as their windows open: one of each
+   client's in turn, its oldest, so that a client with many queued doesn't
+   hold up the others. */
+static void admission_drain(void)
+{
+    struct client_t *c;
+    struct peer_t *p;
+    struct request_t *r;
+
+    while ((c = admission_round.next) != &admission_round && (p = peer_select()) != NULL) {
+        r = c->queued.head;
+        // to the back of the round, admission_remove() takes it out if that was its last
+        client_unlink(c);
+        client_append(&admission_round, c);
+        if (!request_assign(r, p)) {
+            request_shed(r, "no upstream id left");
+            request_done(r);
+        }
+    }
+    if (held_tcp_clients != NULL && admission_len < queue_max)
+        tcp_clients_unhold();
+}
+
+/* Return 0 for a request that is pending or if all slots are full, otherwise
+   return the value of peer_sendreq or peer_connect respectively... */
+int request_add(struct request_t *r)
+{
+    struct client_t *client;
+    struct request_t *req_in_table = NULL;
+    struct request_t *leader;
+    char name[DNS_MAX_NAME + 1];
+    struct in_addr addr;
+    int type;
+
+    printf("adding new request (id=%d)\n", r->rid);
+    if (request_find(&r->a, r->rid) != NULL) {
+        printf("id %d already taken by request from the same client; dropping it\n", r->rid);
+        return 0;
+    }
+
+    // before a token is spent on it
+    if (free_requests == NULL) {
+        request_shed(r, "no free request slots");
+        return 0;
+    }
+
+    // every request counts against its client's in-flight cap, but one
+    // whose question is on its way already costs upstream nothing and
+    // spends no token. Prefetches have no client to charge, see
+    // request_prefetch()
+    leader = question_find(r);
+    client = r->answered ? &local_client : client_get(r->a.sin_addr);
+    if (!client_admit(client, leader == NULL)) {
+        client->throttled++;
+        throttled++;
+        printf("throttling id=%d: client over its limits\n", r->rid);
+        if (shed_rcode >= 0)
+            request_fail(r, shed_rcode);
+        return 0;
+    }
+
+    if (leader != NULL) {
+        req_in_table = request_slot_take(r, COALESCED);
+        client_charge(req_in_table, client);
+        req_in_table->qnext = leader->waiters;
+        leader->waiters = req_in_table;
+        request_index_add(req_in_table);
+        request_stale_arm(req_in_table);
+        coalesced++;
+        printf("id %d coalesced with request id=%d\n", r->rid, leader->rid);
+        return 1;
+    }
+
+    req_in_table = request_slot_take(r, WAITING);
+    req_in_table->start_ms = now_ms();
+    req_in_table->tries = 1;
+    client_charge(req_in_table, client);
+    request_index_add(req_in_table);
+    question_add(req_in_table);
+
+    // plain A and PTR questions can be put to Tor itself, see resolve_start()
+    if (tor_resolve && r->qend >= 0
+        && (type = dns_resolve_question(&r->key, name, &addr)) != 0
+        && resolve_start(req_in_table, type, name, addr)) {
+        req_in_table->active = RESOLVING;
+        request_stale_arm(req_in_table);
+        return 1;
+    }
+
+    if (!request_upstream(req_in_table)) {
+        request_shed(req_in_table, "admission queue full");
+        client_refund(client);
+        request_done(req_in_table);
+        return 0;
+    }
+    request_stale_arm(req_in_table);
+    return 1;
+}
+
+static int rtt_compare(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Sets the hedge delay to the 90th percentile of the recent latencies. */
+static void hedge_update_delay(void)
+{
+    unsigned int sorted[RTT_SAMPLES];
+    unsigned int n = rtt_count < RTT_SAMPLES ? rtt_count : RTT_SAMPLES;
+
+    if (!rtt_fresh || n < RTT_MIN_SAMPLES)
+        return;
+    rtt_fresh = 0;
+    memcpy(sorted, rtt_samples, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), rtt_compare);
+    hedge_delay = sorted[n * 9 / 10];
+    if (hedge_delay < HEDGE_MIN_MS)
+        hedge_delay = HEDGE_MIN_MS;
+}
+
+/* Returns the connected peer a copy of r should go to: preferably one to
+   another nameserver, then the least loaded. NULL if there's none. */
+static struct peer_t *hedge_peer(const struct request_t *r)
+{
+    struct peer_t *best = NULL;
+    int best_other = 0;
+    int i;
+
+    for (i = 0; i < num_peers; i++) {
+        struct peer_t *p = &peers[i];
+        int other = p->ns.s_addr != r->peer->ns.s_addr;
+
+        if (p == r->peer || p->con != CONNECTED || p->draining || peer_load(p) >= window)
+            continue;
+        if (best == NULL || other > best_other
+            || (other == best_other && peer_load(p) < peer_load(best))) {
+            best = p;
+            best_other = other;
+        }
+    }
+    return best;
+}
+
+/* Sends a copy of r over another connection; the first answer to either
+   is used and the other copy is dropped. Returns 1 if the copy is queued. */
+static int request_hedge(struct request_t *r)
+{
+    struct peer_t *p;
+    struct request_t *h;
+    unsigned short int *ul;
+    uint id;
+
+    if ((p = hedge_peer(r)) == NULL || free_requests == NULL)
+        return 0;
+    // the slot peer_id_alloc() maps the id to is the one taken next
+    if ((id = peer_id_alloc(p, free_requests)) == 0)
+        return 0;
+
+    h = request_slot_take(r, WAITING);
+    h->id = id;
+    ul = (unsigned short int*)(h->b + 2);
+    *ul = htons(h->id);
+    h->peer = p;
+    h->qnext = NULL;
+    h->hedge = 1;
+    h->client = NULL;
+    h->tcp = NULL;
+    h->twin = r;
+    r->twin = h;
+    request_set_deadline(h, p);
+    request_list_append(&p->pending, h);
+    peer_handleoutstanding(p);
+
+    hedges_sent++;
+    hedge_credit -= 100;
+    printf("hedging id=%d over %s after %u ms\n", r->rid, peer_display(p), hedge_delay);
+    return 1;
+}
+
+/* r has waited longer than most answers take: a copy of it is sent over
+   another connection, as far as the budget goes. */
+static void request_hedge_due(void *arg)
+{
+    struct request_t *r = arg;
+
+    if (r->twin != NULL || r->peer == NULL || hedge_credit < 100)
+        return;
+    request_hedge(r);
+}
+
+/* Returns the peer a retry of r should go to: the least loaded one other
+   than r's with room in its window, counting a connection still to be
+   made and one to the same nameserver as PEER_CONNECT_COST requests each.
+   r's own peer if there's no other and it has room, r being counted there
+   already; NULL if every window is full. */
+static struct peer_t *retry_peer(const struct request_t *r)
+{
+    struct peer_t *best = peer_load(r->peer) <= window ? r->peer : NULL;
+    int best_cost = 0;
+    int i;
+
+    for (i = 0; i < num_peers; i++) {
+        struct peer_t *p = &peers[i];
+        int cost = peer_load(p);
+
+        if (p == r->peer || p->draining || cost >= window)
+            continue;
+        if (p->con != CONNECTED)
+            cost += PEER_CONNECT_COST;
+        if (p->con != DEAD && p->nsi == r->peer->nsi)
+            cost += PEER_CONNECT_COST;
+        if (best == NULL || best == r->peer || cost < best_cost) {
+            best = p;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+/* Queues r once more on another peer with an upstream id of that peer's
+   or, with every window full, on the admission queue as first sends are.
+   Returns 0 if there's no id left there or the queue is full. */
+static int request_retry(struct request_t *r)
+{
+    struct peer_t *p = retry_peer(r);
+
+    if (p == NULL) {
+        request_unassign(r);
+        r->tries++;
+        retries++;
+        printf("retrying id=%d once a window opens (try %d)\n", r->rid, r->tries);
+        return request_upstream(r);
+    }
+    if (!request_move(r, p))
+        return 0;
+    r->tries++;
+    request_set_deadline(r, p);
+    retries++;
+    printf("retrying id=%d over %s (try %d)\n", r->rid, peer_display(p), r->tries);
+
+    if (p->con == CONNECTED)
+        peer_handleoutstanding(p);
+    else
+        peer_race(p);
+    return 1;
+}
+
+/* The current try of r ran out of time: r is retried on another peer or,
+   with its tries used up, its clients get SERVFAIL so that their stubs
+   move on instead of waiting for their own timeout. */
+static void request_timed_out(void *arg)
+{
+    struct request_t *r = arg;
+    struct request_t *w;
+
+    if (r->active == SENT)
+        ns_timed_out(r->peer);
+    // an unanswered probe means the connection is gone, if quietly
+    if (r->probe) {
+        struct peer_t *p = r->peer;
+
+        request_done(r);
+        printf("probe over %s got no answer\n", peer_display(p));
+        if (p->con == CONNECTED)
+            peer_mark_as_dead(p);
+        return;
+    }
+    // a hedge copy just goes, the original has a deadline of its own
+    if (r->hedge) {
+        r->twin->twin = NULL;
+        r->twin = NULL;
+        request_done(r);
+        return;
+    }
+    // and the hedge copy of a request being retried isn't needed anymore
+    if ((w = r->twin) != NULL) {
+        r->twin = w->twin = NULL;
+        request_done(w);
+    }
+    // a request that never got out of the admission queue isn't retried
+    if (r->peer != NULL && r->tries < max_tries && request_retry(r))
+        return;
+
+    printf("giving up on id=%d after %d tries\n", r->rid, r->tries);
+    servfails++;
+    request_fail(r, DNS_RCODE_SERVFAIL);
+    for (w = r->waiters; w != NULL; w = w->qnext)
+        request_fail(w, DNS_RCODE_SERVFAIL);
+    request_done(r);
+}
+
+/* Starts a non-blocking connection to the SOCKS proxy to ask it for the
+   answer to r, a question of type about name (A) or addr (PTR); the rest
+   is up to resolve_event(). Returns 0 if there's no connection to be had,
+   r is left alone then. */
+static int resolve_start(struct request_t *r, int type, const char *name, struct in_addr addr)
+{
+    struct resolve_t *s = free_resolves;
+    struct epoll_event ev;
+
+    if (s == NULL)
+        return 0;
+    if ((s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket for RESOLVE");
+        return 0;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0
+        || (connect(s->fd, (struct sockaddr*)&socks_addr, sizeof(socks_addr)) != 0
+            && errno != EINPROGRESS)) {
+        perror("connect for RESOLVE");
+        close(s->fd);
+        s->fd = -1;
+        return 0;
+    }
+
+    free_resolves = s->next;
+    s->r = r;
+    s->type = type;
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->addr = addr;
+    s->bl = 0;
+    s->con = CONNECTING;
+    timeout_set(&s->timer, now_ms() + RESOLVE_TIMEOUT_MS);
+    resolves_sent++;
+    printf("resolving id=%d through the proxy\n", r->rid);
+    return 1;
+}
+
+/* Closes the connection of s and puts it back in the pool. */
+static void resolve_end(struct resolve_t *s)
+{
+    close(s->fd);
+    s->fd = -1;
+    s->con = DEAD;
+    s->r = NULL;
+    timeout_cancel(&s->timer);
+    s->next = free_resolves;
+    free_resolves = s;
+}
+
+/* Sends r, which the proxy couldn't resolve, upstream the usual way: the
+   resolver may know better, or at least tell why. Returns 0 if it can't be
+   sent or queued, see request_upstream(). */
+static int resolve_fallback(struct request_t *r)
+{
+    r->active = WAITING;
+    return request_upstream(r);
+}
+
+/* The RESOLVE of s failed or took too long. */
+static void resolve_failed(struct resolve_t *s)
+{
+    struct request_t *r = s->r;
+    struct request_t *w;
+
+    printf("RESOLVE of id=%d failed, asking upstream\n", r->rid);
+    resolve_end(s);
+    resolves_failed++;
+    if (resolve_fallback(r))
+        return;
+    request_fail(r, DNS_RCODE_SERVFAIL);
+    for (w = r->waiters; w != NULL; w = w->qnext)
+        request_fail(w, DNS_RCODE_SERVFAIL);
+    request_done(r);
+}
+
+static void resolve_expired(void *arg)
+{
+    resolve_failed(arg);
+}
+
+/* Sets up the pool of RESOLVE connections of the worker. */
+static void resolve_init(void)
+{
+    int i;
+
+    free_resolves = NULL;
+    for (i = MAX_RESOLVES - 1; i >= 0; i--) {
+        struct resolve_t *s = &resolves[i];
+
+        s->ev = EV_RESOLVE;
+        s->fd = -1;
+        s->con = DEAD;
+        s->r = NULL;
+        timeout_init(&s->timer, resolve_expired, s);
+        s->next = free_resolves;
+        free_resolves = s;
+    }
+}
+
+/* Builds the answer to the request of s from the proxy's RESOLVE reply in
+   s->b and sends it to the clients. Returns 0 if the reply has nothing the
+   question asked for, an IPv6 address say. */
+static int resolve_answer(struct resolve_t *s)
+{
+    unsigned char m[RECV_BUF_SIZE + 12 + DNS_MAX_NAME + 2];
+    unsigned char rd[DNS_MAX_NAME + 2];
+    struct request_t *r = s->r;
+    struct request_t *w;
+    int rdlen, len;
+
+    if (s->type == DNS_TYPE_A && s->b[3] == 1) {
+        memcpy(rd, s->b + 4, 4);
+        rdlen = 4;
+    } else if (s->type == DNS_TYPE_PTR && s->b[3] == 3) {
+        if ((rdlen = dns_name_encode((const char*)s->b + 5, s->b[4], rd)) < 0)
+            return 0;
+    } else {
+        return 0;
+    }
+
+    len = dns_answer_reply(r->b + 2, r->qend, s->type, RESOLVE_TTL, rd, rdlen, m);
+    cache_answer_store(r, m, len);
+    udp_answer_as(r, m, len, 0, 0);
+    for (w = r->waiters; w != NULL; w = w->qnext)
+        udp_answer_as(w, m, len, 0, 0);
+    printf("answering id=%d from RESOLVE (%d bytes)\n", r->rid, len);
+
+    resolves_answered++;
+    resolve_end(s);
+    request_done(r);
+    return 1;
+}
+
+/* Builds the RESOLVE or RESOLVE_PTR request of s in m (7 + DNS_MAX_NAME
+   bytes). Returns its length. */
+static int resolve_request(const struct resolve_t *s, unsigned char *m)
+{
+    int len;
+
+    m[0] = 5;
+    m[2] = 0;
+    if (s->type == DNS_TYPE_A) {
+        m[1] = 0xf0; // RESOLVE
+        m[3] = 3; // domain name
+        m[4] = strlen(s->name);
+        memcpy(m + 5, s->name, m[4]);
+        len = 5 + m[4];
+    } else {
+        m[1] = 0xf1; // RESOLVE_PTR
+        m[3] = 1; // IPv4 address
+        memcpy(m + 4, &s->addr.s_addr, 4);
+        len = 8;
+    }
+    m[len++] = 0; // port, unused
+    m[len++] = 0;
+    return len;
+}
+
+/* Consumes the proxy's reply to the current handshake step of s and sends
+   the next message; the RESOLVE reply gets answered. Returns 1 once s is
+   done, 0 if more bytes are needed, 2 if it advanced a step and -1 on
+   failure. */
+static int resolve_step(struct resolve_t *s)
+{
+    unsigned char m[7 + DNS_MAX_NAME];
+    char user[64];
+    int error_code = 0;
+    socklen_t error_code_size = sizeof(error_code);
+    int need, len;
+
+    switch (s->con) {
+    case CONNECTING:
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error_code, &error_code_size) < 0
+            || error_code != 0)
+            return -1;
+        s->con = SOCKS_METHOD;
+        return write(s->fd, socks_greeting, sizeof(socks_greeting)) == sizeof(socks_greeting) ? 2 : -1;
+    case SOCKS_METHOD:
+        if (s->bl < 2)
+            return 0;
+        if (s->b[0] != 5 || (s->b[1] != 0 && s->b[1] != 2))
+            return -1;
+        need = 2;
+        if (s->b[1] == 2) {
+            // all RESOLVEs of a worker may share a circuit, apart from the peers'
+            snprintf(user, sizeof(user), "ttdnsd-%d-%d-resolve", (int)getpid(), worker_id);
+            len = socks_auth_message(m, user);
+            s->con = SOCKS_AUTH;
+        } else {
+            len = resolve_request(s, m);
+            s->con = SOCKS_REPLY;
+        }
+        break;
+    case SOCKS_AUTH:
+        if (s->bl < 2)
+            return 0;
+        if (s->b[1] != 0)
+            return -1;
+        need = 2;
+        len = resolve_request(s, m);
+        s->con = SOCKS_REPLY;
+        break;
+    case SOCKS_REPLY:
+        if ((need = socks_reply_len(s->b, s->bl)) < 0 || (need > 0 && s->b[1] != 0))
+            return -1;
+        if (need == 0 || s->bl < need)
+            return 0;
+        return resolve_answer(s) ? 1 : -1;
+    case DEAD:
+    case CONNECTED:
+    default:
+        return -1;
+    }
+
+    memmove(s->b, s->b + need, s->bl - need);
+    s->bl -= need;
+    return write(s->fd, m, len) == len ? 2 : -1;
+}
+
+/* Drives the RESOLVE of s as far as it goes whenever its socket becomes
+   ready. */
+static void resolve_event(struct resolve_t *s, uint32_t events)
+{
+    int ret;
+
+    if (s->r == NULL)
+        return;
+    if (s->con == CONNECTING && !(events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+        return;
+    for (;;) {
+        if ((ret = resolve_step(s)) == 2)
+            continue;
+        if (ret == 1)
+            return;
+        if (ret < 0 || s->bl == (int)sizeof(s->b)) {
+            resolve_failed(s);
+            return;
+        }
+
+        ret = read(s->fd, s->b + s->bl, sizeof(s->b) - s->bl);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return;
+        if (ret <= 0) {
+            resolve_failed(s);
+            return;
+        }
+        s->bl += ret;
+    }
+}
+
+/* Prints the clients that sent the most requests, of those still known. */
+static void clients_stats(void)
+{
+    struct client_t *top[CLIENT_TOP];
+    int n = 0, tracked = 0;
+    int i, j;
+
+    for (i = 0; i < max_requests * 2; i++) {
+        struct client_t *c = &clients[i];
+
+        if (!c->used)
+            continue;
+        tracked++;
+        // insertion into the few top ones so far
+        for (j = n < CLIENT_TOP ? n++ : CLIENT_TOP; j > 0 && top[j - 1]->requests < c->requests; j--) {
+            if (j < CLIENT_TOP)
+                top[j] = top[j - 1];
+        }
+        if (j < CLIENT_TOP)
+            top[j] = c;
+    }
+    printf("clients: %d tracked, %lu requests throttled (%d in flight, %d/s each at most)\n",
+           tracked, throttled, client_inflight, client_rate);
+    for (i = 0; i < n; i++)
+        printf("  %s: %lu requests, %d in flight, %lu throttled\n",
+               inet_ntoa(top[i]->addr), top[i]->requests, top[i]->inflight, top[i]->throttled);
+}
+
+static void stats_dump(void)
+{
+    int i;
+
+    printf("worker %d:\n", worker_id);
+    cache_stats();
+    printf("udp: %lu receive batches, %lu datagrams, %lu full; "
+           "%lu send batches, %lu datagrams, %lu full (batch size %d)\n",
+           udp_rx_batches, udp_rx_msgs, udp_rx_full,
+           udp_tx_batches, udp_tx_msgs, udp_tx_full, udp_batch);
+    printf("udp: %lu answers truncated, too large for their client; %lu dropped, "
+           "the socket buffer was full %lu times\n", udp_truncated, udp_dropped, udp_blocks);
+    if (tcp_listen_fd >= 0)
+        printf("tcp: %d clients connected (limit %d), %lu accepted, %lu refused, "
+               "%lu queries, %lu closed idle, %lu held while admission was full\n",
+               tcp_open, tcp_clients_max, tcp_accepted, tcp_refused, tcp_queries, tcp_idle_closed,
+               tcp_holds);
+    printf("requests: %lu coalesced with an identical one in flight, %lu retries, "
+           "%lu answered with SERVFAIL\n", coalesced, retries, servfails);
+    printf("hedging: %lu sent, %lu won, delay %u ms (budget %d%%)\n",
+           hedges_sent, hedges_won, hedge_delay, hedge_budget);
+    printf("connections: %lu keepalive probes, %lu rotated (%d kept warm), "
+           "%lu races, %lu requests moved to the winner\n",
+           probes_sent, rotations, min_warm, races, races_moved);
+    printf("admission: %d queued (peak %d, limit %d), %lu admitted after %llu ms on average "
+           "(max %u ms), %lu shed, %lu reader pauses (window %d)\n",
+           admission_len, admission_peak, queue_max, admitted,
+           admitted ? admission_wait / admitted : 0, admission_wait_max, shed, udp_pauses, window);
+    clients_stats();
+    printf("policy: %lu answered locally, %lu blocked\n", policy_local, policy_blocked);
+    printf("stale: %lu answers served stale after %d ms, %lu instead of errors, "
+           "%lu refreshed ahead (window %u s)\n",
+           stale_served, stale_deadline, stale_rescues, prefetches, stale_window);
+    if (tor_resolve)
+        printf("resolve: %lu asked of the proxy, %lu answered, %lu failed over to DNS\n",
+               resolves_sent, resolves_answered, resolves_failed);
+    for (i = 0; i < (int)num_nameservers; i++) {
+        struct ns_stats_t *s = &ns_stats[i];
+
+        printf("nameserver %s: srtt %u ms, %lu answers, %lu timeouts (%u.%u%%), "
+               "%lu connects, %lu failures (%u.%u%%)%s\n", inet_ntoa(nameservers[i]),
+               s->srtt, s->answers, s->timeouts, s->timeout_rate / 10, s->timeout_rate % 10,
+               s->connects, s->failures, s->fail_rate / 10, s->fail_rate % 10,
+               s->backoff_until > time(NULL) ? ", backed off" : "");
+    }
+    for (i = 0; i < num_peers; i++) {
+        printf("peer %d: %s state %d, %d pending, %d sent, %lu answered\n", i,
+               peer_display(&peers[i]), peers[i].con, peers[i].pending.len,
+               peers[i].sent.len, peers[i].answered);
+    }
+}
+
+static void stats_signal(int sig)
+{
+    (void)sig;
+    stats_generation++;
+}
+
+static void stop_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/* A snapshot serialized by a worker, for snapshot_write() */
+struct snapshot_job_t {
+    int worker;
+    int count;
+    unsigned char *buf;
+    size_t len;
+    unsigned long long start;
+};
+
+/* Writes a snapshot to the file of its worker and frees it. Runs in a
+   thread of its own, so the disk doesn't hold up the event loop. */
+static void *snapshot_write(void *arg)
+{
+    struct snapshot_job_t *job = arg;
+    char name[sizeof(SNAPSHOT_DIR "/" DEFAULT_SNAPSHOT) + 8];
+
+    snprintf(name, sizeof(name), "%s/%s.%d", SNAPSHOT_DIR, DEFAULT_SNAPSHOT, job->worker);
+    if (cache_write(name, job->buf, job->len) == 0)
+        printf("saved %d answers to the cache snapshot in %llu ms\n", job->count, now_ms() - job->start);
+    __atomic_store_n(&snapshot_busy[job->worker], 0, __ATOMIC_RELEASE);
+    free(job->buf);
+    free(job);
+    return NULL;
+}
+
+/* Saves the cache shard of the worker to its snapshot file. The shard is
+   serialized here, the file written by another thread; if wait is set, as
+   when stopping, the previous write is waited for and this one done here. */
+static void snapshot_save(int wait)
+{
+    struct timespec pause = { 0, 10 * 1000 * 1000 };
+    struct snapshot_job_t *job;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (snapshot_interval == 0)
+        return;
+    if (__atomic_load_n(&snapshot_busy[worker_id], __ATOMIC_ACQUIRE)) {
+        if (!wait) {
+            printf("skipping the cache snapshot, the last one is still being written\n");
+            return;
+        }
+        while (__atomic_load_n(&snapshot_busy[worker_id], __ATOMIC_ACQUIRE))
+            nanosleep(&pause, NULL);
+    }
+
+    if (!(job = calloc(1, sizeof(*job)))) {
+        printf("out of memory saving the cache\n");
+        return;
+    }
+    job->worker = worker_id;
+    job->start = now_ms();
+    if ((job->count = cache_dump(time(NULL), &job->buf, &job->len)) < 0) {
+        free(job);
+        return;
+    }
+    __atomic_store_n(&snapshot_busy[worker_id], 1, __ATOMIC_RELEASE);
+
+    if (!wait && pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, snapshot_write, job) == 0) {
+            pthread_attr_destroy(&attr);
+            return;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    snapshot_write(job);
+}
+
+static void snapshot_due(void *arg)
+{
+    (void)arg;
+    snapshot_save(0);
+    timeout_set(&snapshot_timer, now_ms() + snapshot_interval * 1000ULL);
+}
+
+/* Fills the cache shard of the worker from the snapshot files, if they're
+   good, and starts saving it periodically. Clients get spread over the
+   workers anew, so every worker loads every file, its own last to keep
+   what it had the most recently used; the last worker done closes them. */
+static void snapshot_init(void)
+{
+    unsigned long long start = now_ms();
+    int n, total = 0;
+    int i, w;
+
+    if (snapshot_interval == 0)
+        return;
+    for (i = 1; i <= num_workers; i++) {
+        w = (worker_id + i) % num_workers;
+        if (snapshot_fds[w] < 0)
+            continue;
+        if ((n = cache_load(snapshot_fds[w], time(NULL))) < 0)
+            printf("ignoring corrupt cache snapshot %s/%s.%d\n", SNAPSHOT_DIR, DEFAULT_SNAPSHOT, w);
+        else
+            total += n;
+    }
+    printf("loaded %d answers from the cache snapshots in %llu ms\n", total, now_ms() - start);
+    if (__atomic_add_fetch(&snapshot_loaded, 1, __ATOMIC_ACQ_REL) == num_workers) {
+        for (w = 0; w < num_workers; w++) {
+            if (snapshot_fds[w] >= 0)
+                close(snapshot_fds[w]);
+            snapshot_fds[w] = -1;
+        }
+    }
+    timeout_init(&snapshot_timer, snapshot_due, NULL);
+    timeout_set(&snapshot_timer, now_ms() + snapshot_interval * 1000ULL);
+}
+
+/* Answers tmp right away if the policy says so, see policy.c: with the
+   address of a hosts entry, NXDOMAIN for names in a local zone, and
+   NXDOMAIN or 0.0.0.0 for blocked names. Other question types get an empty
+   answer. Returns 1 if it was answered. */
+static int policy_answer(const struct request_t *tmp)
+{
+    unsigned char *m;
+    struct in_addr addr;
+    int type, len;
+    POLICY_ACTION action;
+
+    if (tmp->qend < 0 || (action = policy_lookup(&tmp->key, &addr)) == POLICY_PASS)
+        return 0;
+    type = (tmp->key.k[tmp->key.kl - 5] << 8) | tmp->key.k[tmp->key.kl - 4];
+    if (action == POLICY_BLOCKED) {
+        policy_blocked++;
+        action = POLICY_NXDOMAIN;
+        if (block_zero) {
+            action = POLICY_ADDR;
+            addr.s_addr = INADDR_ANY;
+        }
+    } else {
+        policy_local++;
+    }
+
+    m = udp_answer_reserve(tmp->bl + 12 + 4);
+    switch (action) {
+    case POLICY_ADDR:
+        if (type == DNS_TYPE_A) {
+            len = dns_answer_reply(tmp->b + 2, tmp->qend, DNS_TYPE_A, POLICY_TTL,
+                                   (unsigned char*)&addr.s_addr, 4, m);
+            break;
+        }
+        len = dns_error_reply(tmp->b + 2, tmp->bl, DNS_RCODE_NOERROR, m);
+        break;
+    case POLICY_NODATA:
+        len = dns_error_reply(tmp->b + 2, tmp->bl, DNS_RCODE_NOERROR, m);
+        break;
+    case POLICY_NXDOMAIN:
+    case POLICY_PASS:
+    case POLICY_BLOCKED:
+    default:
+        len = dns_error_reply(tmp->b + 2, tmp->bl, DNS_RCODE_NXDOMAIN, m);
+        break;
+    }
+    answer_commit(tmp, len);
+    printf("answering id=%d from the policy\n", tmp->rid);
+    return 1;
+}
+
+static void process_incoming_request(struct request_t *tmp) {
+    // get request id
+    unsigned short int *ul = (unsigned short int*) (tmp->b + 2);
+    tmp->rid = tmp->id = ntohs(*ul);
+    // get request length
+    ul = (unsigned short int*)tmp->b;
+    *ul = htons(tmp->bl);
+
+    printf("received request of %d bytes, id = %d\n", tmp->bl, tmp->id);
+
+    if ((tmp->qend = dns_question_key(tmp->b + 2, tmp->bl, &tmp->key)) >= 0)
+        tmp->qhash = dns_key_hash(&tmp->key);
 
-    
-    if (setsockopt(p->tcp_fd, SOL_SOCKET, SO_REUSEADDR, &socket_opt_val, sizeof(int)))
-         printf("Setting SO_REUSEADDR failed\n");
+    if (policy_answer(tmp))
+        return;
+    if (cache_answer_request(tmp))
+        return;
 
-    if (fcntl(p->tcp_fd, F_SETFL, O_NONBLOCK))
-        printf("Setting O_NONBLOCK failed\n");
-    //We should be in non-blocking mode now
-    p->bl = 0;
-    p->con = CONNECTING;
+    request_add(tmp); // This should be checked; we're currently ignoring important returns.
+}
+
+/* Takes the complete queries in the receive buffer of c through the same
+   stages as datagrams, as many as --tcp-pipeline lets in; c is paused at
+   the limit, and held while the admission queue is full. Returns 0 if c
+   got closed on the way. */
+static int tcp_client_parse(struct tcp_client_t *c)
+{
+    int pos = 0;
+    int len;
 
+    c->paused = 0;
+    while (c->bl - pos >= 2) {
+        len = (c->b[pos] << 8) | c->b[pos + 1];
+        // a request_t holds no more, and no query needs more
+        if (len > RECV_BUF_SIZE - 2) {
+            tcp_client_close(c, "query too long");
+            return 0;
+        }
+        if (pos + 2 + len > c->bl)
+            break;
+        if (c->inflight >= tcp_pipeline) {
+            c->paused = 1;
+            break;
+        }
+        if (admission_len >= queue_max) {
+            tcp_client_hold(c);
+            break;
+        }
+        memcpy(tcp_in.b + 2, c->b + pos + 2, len);
+        tcp_in.bl = len;
+        tcp_in.a = c->a;
+        tcp_in.al = sizeof(c->a);
+        tcp_in.tcp = c;
+        pos += 2 + len;
+        tcp_queries++;
+        process_incoming_request(&tcp_in);
+        if (c->fd < 0)
+            return 0;
+    }
+    memmove(c->b, c->b + pos, c->bl - pos);
+    c->bl -= pos;
     return 1;
 }
 
-/* Returns 1 upon non-blocking connection; 0 upon serious error */
-int peer_connected(struct peer_t *p)
+/* Reads queries off c until the socket runs dry, it's edge-triggered, or
+   c is paused. A client done sending is closed once it's answered. */
+static void tcp_client_read(struct tcp_client_t *c)
 {
-    int cs;
-//      /* QUASIBUG This is not documented as a correct way to poll for
-//         connection establishment. Linux connect(2) says: “Generally,
-//         connection-based protocol sockets may successfully connect()
-//         only once...It is possible to select(2) or poll(2) for
-//         completion by selecting the socket for writing.  After
-//         select(2) indicates writability, use getsockopt(2) to read the
-//         SO_ERROR option at level SOL_SOCKET to determine whether
-//         connect() completed successfully (SO_ERROR is zero) or
-//         unsuccessfully (SO_ERROR is one of the usual error codes listed
-//         here, explaining the reason for the failure).”
-// 
-//         If this works the way it’s documented to work, we should just
-//         use the documented interface.
-//      */
-// 
-    
-    int error_code;
-    socklen_t error_code_size = sizeof(error_code);
-    getsockopt(p->tcp_fd, SOL_SOCKET, SO_ERROR, &error_code, &error_code_size);
+    int ret;
 
-    
-     if (error_code == 0) {
-        p->con = CONNECTED;
-        return 1;
-    } else {
-        printf("connection failed with code:%d\n",error_code);
-        printf("Is Tor running?\n");
-        close(p->tcp_fd);
-        p->tcp_fd = -1;
-        p->con = DEAD;
-        return 0;
+    for (;;) {
+        if (!tcp_client_parse(c) || c->paused || c->held)
+            return;
+        if (c->eof) {
+            if (c->inflight == 0 && c->ob_len == 0)
+                tcp_client_close(c, "done");
+            return;
+        }
+        ret = read(c->fd, c->b + c->bl, sizeof(c->b) - c->bl);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return;
+        if (ret < 0) {
+            tcp_client_close(c, strerror(errno));
+            return;
+        }
+        if (ret == 0) {
+            c->eof = 1;
+            continue;
+        }
+        c->bl += ret;
+        timeout_set(&c->timer, now_ms() + tcp_idle * 1000ULL);
     }
-
-  printf("%s %d",peer_display(p),cs);
-return 1;
 }
 
-/*
-int peer_keepalive(uint peer)
+/* Reads the connections again whose requests left the table since, see
+   tcp_client_done(). */
+static void tcp_clients_resume(void)
 {
-    return 1;
+    struct tcp_client_t *c;
+
+    while ((c = resume_tcp_clients) != NULL) {
+        resume_tcp_clients = c->next;
+        c->resume = 0;
+        if (c->fd >= 0)
+            tcp_client_read(c);
+        else if (c->inflight == 0)
+            tcp_client_free(c);
+    }
 }
-*/
 
-static void peer_mark_as_dead(struct peer_t *p)
+/* The idle timer of c ran out. Waiting for the upstream isn't idling, its
+   requests have deadlines of their own, but not taking answers is. */
+static void tcp_client_expired(void *arg)
 {
-    close(p->tcp_fd);
-    p->tcp_fd = -1;
-    p->con = DEAD;
-    printf("peer %s got disconnected\n", peer_display(p));
+    struct tcp_client_t *c = arg;
+
+    if (c->inflight > 0 && c->ob_len == 0) {
+        timeout_set(&c->timer, now_ms() + tcp_idle * 1000ULL);
+        return;
+    }
+    tcp_idle_closed++;
+    tcp_client_close(c, c->ob_len > 0 ? "answers not read" : "idle");
 }
 
-/* Returns 1 upon sent request; 0 upon serious error and 2 upon disconnect */
-int peer_sendreq(struct peer_t *p, struct request_t *r)
+static void tcp_client_event(struct tcp_client_t *c, uint32_t events)
 {
-    int ret;
-    r->active = SENT;        /* BUG: even if the write below fails? */
-
-     /* QUASIBUG Busy-waiting on the network buffer to free up some
-        space is not acceptable; at best, it wastes CPU; at worst, it
-        hangs the daemon until the TCP timeout informs it that its
-        connection to Tor has timed out. (Although that’s an unlikely
-        failure mode.) */
-    /* BUG: what if write() doesn't write all the data? */
-    /* This is writing data to the remote DNS server over Tor with TCP */
-    while ((ret = write(p->tcp_fd, r->b, (r->bl + 2))) < 0 && errno == EAGAIN);
-    printf("peer_sendreq write attempt returned: %d\n", ret);
-    if (ret == 0) {
-        peer_mark_as_dead(p);
-        return 2;
+    if (c->fd < 0)
+        return;
+    if (events & EPOLLERR) {
+        tcp_client_close(c, "connection error");
+        return;
+    }
+    if ((events & EPOLLOUT) && !tcp_client_flush(c)) {
+        tcp_client_close(c, strerror(errno));
+        return;
     }
+    if (events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP))
+        tcp_client_read(c);
+    else if (c->eof && c->inflight == 0 && c->ob_len == 0)
+        tcp_client_close(c, "done");
+}
 
+/* Accepts the connections waiting on the listener until it runs dry, it's
+   edge-triggered. Those over --tcp-clients are closed right away. */
+static void tcp_accept(void)
+{
+    struct epoll_event ev;
+    struct tcp_client_t *c;
+    struct sockaddr_in a;
+    socklen_t al;
+    int one = 1;
+    int fd;
 
-    return 1;
+    for (;;) {
+        al = sizeof(a);
+        if ((fd = accept4(tcp_listen_fd, (struct sockaddr*)&a, &al, SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN)
+                perror("accept4 on TCP fd");
+            return;
+        }
+        if ((c = free_tcp_clients) == NULL) {
+            printf("refusing TCP client %s, %d connected\n", inet_ntoa(a.sin_addr), tcp_open);
+            tcp_refused++;
+            close(fd);
+            continue;
+        }
+        // answers go out whole, Nagle would just hold them back
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl on TCP client");
+            close(fd);
+            continue;
+        }
+        free_tcp_clients = c->next;
+        c->fd = fd;
+        c->a = a;
+        c->bl = 0;
+        timeout_set(&c->timer, now_ms() + tcp_idle * 1000ULL);
+        tcp_open++;
+        tcp_accepted++;
+        printf("accepted TCP client %s:%d\n", inet_ntoa(a.sin_addr), ntohs(a.sin_port));
+    }
 }
 
-/* Returns -1 on error, returns 1 on something, returns 2 on something, returns 3 on disconnect. */
-/* XXX This function needs a really serious re-write/audit/etc. */
-int peer_readres(struct peer_t *p)
+/* Sets up the client connection slots around the listener fd, -1 if there
+   is none. Returns 1 on success. */
+static int tcp_init(int fd)
 {
-    struct request_t *r;
-    int ret;
-    unsigned short int *ul;
-    int id;
-    int req;
-    unsigned short int *l;
-    int len;
+    int i;
 
-    l = (unsigned short int*)p->b;
-
-     /* BUG: we’re reading on a TCP socket here, so we could in theory
-        get a partial response. Using TCP puts the onus on the user
-        program (i.e. this code) to buffer bytes until we have a
-        parseable response. This probably won’t happen very often in
-        practice because even with DF, the path MTU is unlikely to be
-        smaller than the DNS response. But it could happen.  And then
-        we fall into the `processanswer` code below without having the
-        whole answer. */
-    /* This is reading data from Tor over TCP */
-    while ((ret = read(p->tcp_fd, (p->b + p->bl), (RECV_BUF_SIZE - p->bl))) < 0 && errno == EAGAIN);
-    printf("peer_readres read attempt returned: %d\n", ret);
-    if (ret == 0) {
-        peer_mark_as_dead(p);
-        return 3;
+    tcp_listen_fd = fd;
+    if (fd < 0)
+        return 1;
+    if (!(tcp_clients = calloc(tcp_clients_max, sizeof(tcp_clients[0]))))
+        return 0;
+    free_tcp_clients = NULL;
+    for (i = tcp_clients_max - 1; i >= 0; i--) {
+        tcp_clients[i].ev = EV_TCP_CLIENT;
+        tcp_clients[i].fd = -1;
+        timeout_init(&tcp_clients[i].timer, tcp_client_expired, &tcp_clients[i]);
+        tcp_client_free(&tcp_clients[i]);
     }
+    return 1;
+}
 
-    p->bl += ret;
-
-    // get answer from receive buffer
-    do {
+/* Runs every HOUSEKEEPING_INTERVAL seconds off its timer: updates the
+   hedge delay, reconnects dead peers that still have requests queued or
+   are needed warm and lets go of idle connections to slow nameservers, so
+   nothing has to wait or sleep inside the loop. */
+static void housekeeping(void *arg)
+{
+    unsigned long long best = ns_best_score();
+    int i;
 
-        if (p->bl < 2) {
-            return 2;
-        }
-        else {
-            len = ntohs(*l);
+    (void)arg;
+    timeout_set(&housekeeping_timer, now_ms() + HOUSEKEEPING_INTERVAL * 1000ULL);
+    hedge_update_delay();
 
-            printf("r l=%d r=%d\n", len, p->bl-2);
+    for (i = 0; i < num_peers; i++) {
+        struct peer_t *p = &peers[i];
 
-            if ((len + 2) > p->bl)
-                return 2;
+        switch (p->con) {
+        case DEAD:
+            if (p->pending.len > 0)
+                peer_race(p);
+            break;
+        case CONNECTED:
+            // idle connections to a much worse nameserver are let go, the
+            // next one goes through ns_select() again
+            if (peer_load(p) == 0 && !p->draining && ns_stats[p->nsi].answers >= RTT_MIN_SAMPLES
+                && best > 0 && ns_score(p->nsi) > NS_ROTATE_FACTOR * best) {
+                printf("closing idle connection to slow nameserver %s\n", peer_display(p));
+                peer_mark_as_dead(p);
+            }
+            break;
+        case CONNECTING:
+        case SOCKS_METHOD:
+        case SOCKS_AUTH:
+        case SOCKS_REPLY:
+            // the SOCKS handshake has a timer of its own, see peer_expired()
+        default:
+            break;
         }
+    }
+    peers_warm();
+}
 
-        printf("received answer %d bytes\n", p->bl);
-
-        ul = (unsigned short int*)(p->b + 2);
-        id = ntohs(*ul);
+/* Dispatches the readiness of a peer's socket by connection state. */
+static void peer_event(struct peer_t *p, uint32_t events)
+{
+    int r;
 
-        if ((req = request_find(id)) == -1) {
-            memmove(p->b, (p->b + len + 2), (p->bl - len - 2));
-            p->bl -= len + 2;
-            return 0;
+    switch (p->con) {
+    case CONNECTED:
+        if (events & (EPOLLIN|EPOLLPRI|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+            peer_readres(p);
+        if (p->con == CONNECTED && (events & EPOLLOUT) && peer_flush(p))
+            peer_handleoutstanding(p);
+        break;
+    case CONNECTING:
+    case SOCKS_METHOD:
+    case SOCKS_AUTH:
+    case SOCKS_REPLY:
+        r = peer_handshake(p);
+        if (r > 0) {
+            peer_race_won(p);
+            peer_handleoutstanding(p);
+            peer_idle_check(p);
+        } else if (r < 0) {
+            peer_mark_as_dead(p);
         }
-        r = &requests[req];
-
-        // write back real id
-        *ul = htons(r->rid);
-
-        // Remove the AD flag from the reply if it has one. Because we might be
-        // answering requests to 127.0.0.1, the client might consider us
-        // trusted. While trusted, we shouldn't indicate that data is DNSSEC
-        // valid when we haven't checked it.
-        // See http://tools.ietf.org/html/rfc2535#section-6.1
-        if (len >= 6)
-          p->b[5] &= 0xdf;
-
-        /* This is where we send the answer over UDP to the client */
-        r->a.sin_family = AF_INET;
-        while (sendto(udp_fd, (p->b + 2), len, 0, (struct sockaddr*)&r->a, sizeof(struct sockaddr_in)) < 0 && errno == EAGAIN);
+        break;
+    case DEAD:
+    default:
+        // housekeeping() takes care of it, never sleep in here
+        printf("peer %s in bad state %i\n", peer_display(p), p->con);
+        break;
+    }
+}
 
-        printf("forwarding answer (%d bytes)\n", len);
+/* Reads datagrams udp_batch at a time until udp_fd is drained; it's
+   edge-triggered. A batch that comes back short means the socket ran dry,
+   which saves the syscall that would just return EAGAIN. */
+static void udp_readreqs(void)
+{
+    int n;
+    int i;
 
-        memmove(p->b, p->b + len +2, p->bl - len - 2);
-        p->bl -= len + 2;
+    for (;;) {
+        // the kernel buffers what comes in meanwhile, see worker_loop()
+        if (admission_len >= queue_max) {
+            if (!udp_paused)
+                udp_pauses++;
+            udp_paused = 1;
+            return;
+        }
+        for (i = 0; i < udp_batch; i++)
+            udp_in_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
 
-        // mark as handled/unused
-        r->id = 0;
+        n = recvmmsg(udp_fd, udp_in_msgs, udp_batch, 0, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                perror("recvmmsg on UDP fd");
+            return;
+        }
 
-    } while (p->bl > 0);
+        udp_rx_batches++;
+        udp_rx_msgs += n;
+        if (n == udp_batch)
+            udp_rx_full++;
 
-    return 1;
+        for (i = 0; i < n; i++) {
+            udp_in[i].al = udp_in_msgs[i].msg_hdr.msg_namelen;
+            udp_in[i].bl = udp_in_msgs[i].msg_len;
+            process_incoming_request(&udp_in[i]);
+        }
+        if (n < udp_batch)
+            return;
+    }
 }
 
-/* Handles outstanding peer requests and does not return anything. */
-void peer_handleoutstanding(struct peer_t *p)
+/* Sets up the peers, tables, cache shard and event loop of worker id around
+   its UDP socket fd and TCP listener tcp_fd, -1 without TCP. Returns 0 on
+   success, -1 on failure. */
+static int worker_init(int id, int fd, int tcp_fd)
 {
+    struct epoll_event ev;
+    unsigned int shard;
     int i;
-    int ret;
 
-    /* QUASIBUG It doesn’t make sense that sometimes `request_add`
-        will queue up a request to be sent to nameserver #2 when a
-        connection is already open to nameserver #1, but then send that
-        request to nameserver #3 if nameserver #3 happens to finish
-        opening its connection before nameserver #2. */
+    worker_id = id;
+    udp_fd = fd;
+    timeouts_init(now_ms());
 
-    for (i = 0; i < MAX_REQUESTS; i++) {
-        struct request_t *r = &requests[i];
-        if (r->id != 0 && r->active == WAITING) {
-            ret = peer_sendreq(p, r);
-            printf("peer_sendreq returned %d\n", ret);
+    for (i = 0; i < num_peers; i++) {
+        if (!peer_init(&peers[i])) {
+            printf("can't set up the id space of peer %d\n", i);
+            return(-1);
         }
+        timeout_init(&peers[i].timer, peer_expired, &peers[i]);
+        timeout_init(&peers[i].rotate, peer_rotate, &peers[i]);
     }
-}
+    if (!request_init()) {
+        printf("can't allocate %d request slots\n", max_requests);
+        return(-1);
+    }
+    if (!clients_init()) {
+        printf("can't allocate the accounting of %d clients\n", max_requests * 2);
+        return(-1);
+    }
+    resolve_init();
 
-/* Currently, we only return the 0th peer. Someday we might want more? */
-/* REFACTOR if we aren't going to round-robin among the peers, we
-   should remove all the complexity having to do with having more than
-   one peer. */
-struct peer_t *peer_select(void)
-{
-    return &peers[0];
-}
+    // the cache is split evenly between the workers
+    shard = (cache_size + num_workers - 1) / num_workers;
+    if (!cache_init(shard, stale_window)) {
+        printf("can't allocate a cache of %u entries\n", shard);
+        return(-1);
+    }
+    snapshot_init();
 
-/* Selects a random nameserver from the pool and returns the number. */
-struct in_addr ns_select(void)
-{
-    // This could use a real bit of randomness, I suspect
-    return nameservers[(rand()>>16) % num_nameservers];
+    if (!udp_init()) {
+        printf("can't allocate UDP batches of %d datagrams\n", udp_batch);
+        return(-1);
+    }
+    if (!tcp_init(tcp_fd)) {
+        printf("can't allocate %d TCP client connections\n", tcp_clients_max);
+        return(-1);
+    }
+
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        return(-1);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN|EPOLLET;
+    ev.data.ptr = &udp_ev;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev) < 0) {
+        perror("epoll_ctl on UDP fd");
+        return(-1);
+    }
+    ev.data.ptr = &tcp_listen_ev;
+    if (tcp_listen_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_listen_fd, &ev) < 0) {
+        perror("epoll_ctl on TCP fd");
+        return(-1);
+    }
+
+    timeout_init(&housekeeping_timer, housekeeping, NULL);
+    timeout_set(&housekeeping_timer, now_ms() + HOUSEKEEPING_INTERVAL * 1000ULL);
+    peers_warm();
+    return 0;
 }
 
-/* Return 0 for a request that is pending or if all slots are full, otherwise
-   return the value of peer_sendreq or peer_connect respectively... */
-int request_add(struct request_t *r)
+/* Runs the event loop of the calling worker. Returns 0 once the daemon is
+   told to stop and the cache is saved, -1 if epoll breaks. */
+static int worker_loop(void)
 {
-    uint pos = r->id % MAX_REQUESTS; // XXX r->id is unchecked
-    struct peer_t *dst_peer;
-    unsigned short int *ul;
-    time_t ct = time(NULL);
-    struct request_t *req_in_table = 0;
+    struct epoll_event events[MAX_EVENTS];
+    int fr;
+    int i;
 
-    printf("adding new request (id=%d)\n", r->id);
     for (;;) {
-        if (requests[pos].id == 0) {
-            // this one is unused, take it
-            printf("new request added at pos: %d\n", pos);
-            req_in_table = &requests[pos];
-            break;
+        // SIGUSR1 interrupts one worker, the others notice at the latest on
+        // their next housekeeping()
+        if (stats_seen != stats_generation) {
+            stats_seen = stats_generation;
+            stats_dump();
         }
-        else {
-            if (requests[pos].id == r->id) {
-                if (memcmp((char*)&r->a, (char*)&requests[pos].a, sizeof(r->a)) == 0) {
-                    printf("hash position %d already taken by request with same id; dropping it\n", pos);
-                    return 0;
-                }
-                else {
-                    printf("hash position %d selected\n", pos);
-                     /* REFACTOR If it’s okay to do this, it would be
-                        simpler to always do it, instead of only on
-                        collisions. Then, if it’s buggy, it’ll show up
-                        consistently in testing. */
-                    do {
-                        r->id = ((rand()>>16) % 0xffff);
-                    } while (r->id < 1);
-                    pos = r->id % MAX_REQUESTS;
-                    printf("NATing id (id was %d now is %d)\n", r->rid, r->id);
-                    continue;
-                }
-            }
-            else if ((requests[pos].timeout + MAX_TIME) > ct) {
-                // request timed out, take it
-                printf("taking pos from timed out request\n");
-                req_in_table = &requests[pos];
-                break;
-            }
-            else {
-                pos++;
-                pos %= MAX_REQUESTS;
-                if (pos == (r->id % MAX_REQUESTS)) {
-                    printf("no more free request slots, wow this is a busy node. dropping request!\n");
-                    return 0;
-                }
-            }
+        // and so does SIGTERM
+        if (stopping) {
+            snapshot_save(1);
+            return 0;
         }
-    }
-    printf("using request slot %d\n", pos); /* REFACTOR: move into loop */
+        policy_refresh(worker_id);
 
-    r->timeout = time(NULL); /* REFACTOR not ct? sloppy */
+        // sleep until the next timeout is due, see timer.c
+        fr = epoll_wait(epoll_fd, events, MAX_EVENTS, timeouts_next(now_ms()));
+        if (fr < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return(-1);
+        }
 
-    // update id
-    ul = (unsigned short int*)(r->b + 2);
-    *ul = htons(r->id);
-    printf("updating id: %d\n", htons(r->id));
+        printf("%d file descriptors became ready\n", fr);
 
-    if ( req_in_table == NULL ) {
-        return -1;
-    } else {
-        memcpy((char*)req_in_table, (char*)r, sizeof(*req_in_table));
-    }
+        for (i = 0; i < fr; i++) {
+            switch (*(EV_TYPE*)events[i].data.ptr) {
+            case EV_PEER:
+                peer_event(events[i].data.ptr, events[i].events);
+                break;
+            case EV_UDP:
+                if (events[i].events & EPOLLOUT)
+                    udp_writable();
+                if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+                    udp_readreqs();
+                break;
+            case EV_RESOLVE:
+                resolve_event(events[i].data.ptr, events[i].events);
+                break;
+            case EV_TCP_LISTEN:
+                tcp_accept();
+                break;
+            case EV_TCP_CLIENT:
+                tcp_client_event(events[i].data.ptr, events[i].events);
+                break;
+            default:
+                break;
+            }
+        }
 
-    // XXX: nice feature to have: send request to multiple peers for speedup and reliability
-    printf("selecting peer\n");
-    dst_peer = peer_select();
-    printf("peer selected: %d\n", dst_peer->tcp_fd);
+        timeouts_run(now_ms());
 
-    if (dst_peer->con == CONNECTED) {
-        return peer_sendreq(dst_peer, req_in_table);
-    }
-    else {
-        // The request will be sent by peer_handleoutstanding when the
-        // connection is established. Actually (see QUASIBUG notice
-        // earlier) when *any* connection is established.
-        return peer_connect(dst_peer, ns_select());
+        // answers made room: queued requests go first, then the socket is
+        // read again if it was left alone, edge-triggered epoll won't say
+        admission_drain();
+        tcp_clients_resume();
+        if (udp_paused && admission_len < queue_max) {
+            udp_paused = 0;
+            udp_readreqs();
+        }
+
+        peers_flush();
+        udp_flush();
     }
 }
 
-static void process_incoming_request(struct request_t *tmp) {
-    // get request id
-    unsigned short int *ul = (unsigned short int*) (tmp->b + 2);
-    tmp->rid = tmp->id = ntohs(*ul);
-    // get request length
-    ul = (unsigned short int*)tmp->b;
-    *ul = htons(tmp->bl);
+static int worker_fds[MAX_WORKERS]; /**< UDP socket of each worker */
+static int tcp_listen_fds[MAX_WORKERS]; /**< TCP listener of each worker, -1 without */
+static pthread_t worker_tids[MAX_WORKERS];
 
-    printf("received request of %d bytes, id = %d\n", tmp->bl, tmp->id);
+/* Thread body of the workers other than 0; arg points into worker_fds. */
+static void *worker_thread(void *arg)
+{
+    int id = (int*)arg - worker_fds;
 
-    request_add(tmp); // This should be checked; we're currently ignoring important returns.
+    if (worker_init(id, worker_fds[id], tcp_listen_fds[id]) < 0 || worker_loop() < 0) {
+        printf("worker %d failed, exit\n", id);
+        exit(1);
+    }
+    return NULL;
 }
 
+/* Binds one UDP socket and one TCP listener per worker, SO_REUSEPORT
+   letting the kernel spread the clients over them, drops privileges and
+   runs the workers. Worker 0
+   is the calling thread, so this only returns on failure or once the
+   workers stopped. */
 int server(char *bind_ip, int bind_port)
 {
     struct sockaddr_in udp;
-    struct pollfd pfd[MAX_PEERS+1];
-    int poll2peers[MAX_PEERS];
-    int fr;
+    struct sigaction sa;
+    char name[sizeof(SNAPSHOT_DIR "/" DEFAULT_SNAPSHOT) + 8];
+    int one = 1;
+    int fd;
     int i;
-    int pfd_num;
     int r;
 
-    for (i = 0; i < MAX_PEERS; i++) {
-        peers[i].tcp_fd = -1;
-        poll2peers[i] = -1;
-        peers[i].con = DEAD;
-    }
-    memset((char*)requests, 0, sizeof(requests)); // Why not bzero?
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = stop_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
 
-    // setup listing port - someday we may also want to listen on TCP just for fun
-    if ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        printf("can't create UDP socket\n");
-        return(-1);
-    }
     memset((char*)&udp, 0, sizeof(struct sockaddr_in)); // bzero love
     udp.sin_family = AF_INET;
     udp.sin_addr.s_addr = INADDR_ANY;    
@@ -548,11 +3639,75 @@ int server(char *bind_ip, int bind_port)
         return(0); // Why is this 0?
     }
 
-    if (bind(udp_fd, (struct sockaddr*)&udp, sizeof(struct sockaddr_in)) < 0) {
-        printf("can't bind to %s:%d\n", bind_ip, bind_port);
-        close(udp_fd);
-        return(-1); // Perhaps this should be more useful?
+    // setup listening ports, all bound before dropping privileges: port 53 needs root
+    for (i = 0; i < num_workers; i++) {
+        if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            printf("can't create UDP socket\n");
+            return(-1);
+        }
+        if (num_workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+            perror("setsockopt SO_REUSEPORT");
+            close(fd);
+            return(-1);
+        }
+        if (bind(fd, (struct sockaddr*)&udp, sizeof(struct sockaddr_in)) < 0) {
+            printf("can't bind to %s:%d\n", bind_ip, bind_port);
+            close(fd);
+            return(-1); // Perhaps this should be more useful?
+        }
+        if (fcntl(fd, F_SETFL, O_NONBLOCK))
+            printf("Setting O_NONBLOCK failed\n");
+        worker_fds[i] = fd;
+    }
+
+    // clients that got a truncated answer ask again over TCP, forwarders
+    // may keep a connection open. TCP is an extra: a worker that can't
+    // listen serves UDP alone and doesn't truncate, see udp_fit()
+    for (i = 0; i < num_workers; i++) {
+        tcp_listen_fds[i] = -1;
+        if (tcp_clients_max == 0)
+            continue;
+        if ((fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) {
+            perror("warning: can't create TCP socket, serving UDP only");
+            continue;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+            || (num_workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)) {
+            perror("warning: setsockopt on TCP fd, serving UDP only");
+            close(fd);
+            continue;
+        }
+        if (bind(fd, (struct sockaddr*)&udp, sizeof(struct sockaddr_in)) < 0
+            || listen(fd, SOMAXCONN) < 0) {
+            printf("warning: can't listen on TCP %s:%d: %s, serving UDP only\n",
+                   bind_ip, bind_port, strerror(errno));
+            close(fd);
+            continue;
+        }
+        tcp_listen_fds[i] = fd;
+    }
+
+    // the chroot may only be writable by root, so new snapshots are renamed
+    // into a directory of nobody's; the old ones are opened now, a worker
+    // without one just starts cold
+    if (snapshot_interval > 0) {
+        if (mkdir(SNAPSHOT_DIR, 00700) < 0 && errno != EEXIST)
+            printf("can't create %s: %s\n", SNAPSHOT_DIR, strerror(errno));
+        else if (!DEBUG && chown(SNAPSHOT_DIR, NOBODY, NOGROUP) < 0)
+            printf("can't chown %s: %s\n", SNAPSHOT_DIR, strerror(errno));
     }
+    for (i = 0; i < num_workers; i++) {
+        snapshot_fds[i] = -1;
+        if (snapshot_interval == 0)
+            continue;
+        snprintf(name, sizeof(name), "%s/%s.%d", SNAPSHOT_DIR, DEFAULT_SNAPSHOT, i);
+        if ((snapshot_fds[i] = open(name, O_RDONLY|O_CLOEXEC)) < 0 && errno != ENOENT)
+            printf("can't open cache snapshot %s: %s\n", name, strerror(errno));
+    }
+
+    // reloaded on SIGHUP from then on, the files have to be readable by nobody
+    if (!policy_start())
+        return(-1);
 
     // drop privileges
     if (!DEBUG) {
@@ -568,86 +3723,22 @@ int server(char *bind_ip, int bind_port)
         }
     }
 
-    for (;;) {
-        // populate poll array
-        for (pfd_num = 1, i = 0; i < MAX_PEERS; i++) {  
-            if (peers[i].tcp_fd != -1) {
-                pfd[pfd_num].fd = peers[i].tcp_fd;
-                switch (peers[i].con) {
-                case CONNECTED:
-                    pfd[pfd_num].events = POLLIN|POLLPRI;
-                    break;
-                case DEAD:
-                    pfd[pfd_num].events = POLLOUT|POLLERR;
-                    break;
-                case CONNECTING:
-                    pfd[pfd_num].events = POLLOUT|POLLERR;
-                    break;
-                case CONNECTING2:
-                    pfd[pfd_num].events = POLLOUT|POLLERR;
-                    break;
-                default:
-                    pfd[pfd_num].events = POLLOUT|POLLERR;
-                    break;
-                }
-                poll2peers[pfd_num-1] = i;
-                pfd_num++;
-            }
-        }
-
-        pfd[0].fd = udp_fd;
-        pfd[0].events = POLLIN|POLLPRI;
-
-        printf("watching %d file descriptors\n", pfd_num);
-
-        fr = poll(pfd, pfd_num, -1);
-
-        printf("%d file descriptors became ready\n", fr);
-
-        // handle tcp connections
-        for (i = 1; i < pfd_num; i++) {
-            if (pfd[i].fd != -1 && ((pfd[i].revents & POLLIN) == POLLIN || 
-                    (pfd[i].revents & POLLPRI) == POLLPRI || (pfd[i].revents & POLLOUT) 
-                    == POLLOUT || (pfd[i].revents & POLLERR) == POLLERR)) {
-                uint peer = poll2peers[i-1];
-                struct peer_t *p = &peers[peer];
-
-                if (peer > MAX_PEERS) {
-                    printf("Something is wrong! poll2peers[%i] is larger than MAX_PEERS: %i\n", i-1, peer);
-                } else switch (p->con) {
-                case CONNECTED:
-                    peer_readres(p);
-                    break;
-                case CONNECTING:
-                case CONNECTING2:
-                    if (peer_connected(p)) {
-                        peer_handleoutstanding(p);
-                    }
-                    break;
-                case DEAD:
-                default:
-                    printf("peer %s in bad state %i\n", peer_display(p), p->con);
-		    sleep(1);
-                    break;
-                }
-            }
+    for (i = 1; i < num_workers; i++) {
+        if ((r = pthread_create(&worker_tids[i], NULL, worker_thread, &worker_fds[i])) != 0) {
+            printf("can't start worker %d: %s\n", i, strerror(r));
+            return(-1);
         }
+    }
 
-        // handle port 53
-        if ((pfd[0].revents & POLLIN) == POLLIN || (pfd[0].revents & POLLPRI) == POLLPRI) {
-            struct request_t tmp;
-            memset((char*)&tmp, 0, sizeof(struct request_t)); // bzero
-            tmp.al = sizeof(struct sockaddr_in);
+    if (worker_init(0, worker_fds[0], tcp_listen_fds[0]) < 0)
+        return(-1);
+    if ((r = worker_loop()) < 0)
+        return r;
 
-            tmp.bl = recvfrom(udp_fd, tmp.b+2, RECV_BUF_SIZE-2, 0, 
-                              (struct sockaddr*)&tmp.a, &tmp.al);
-            if (tmp.bl < 0) {
-                perror("recvfrom on UDP fd");
-            } else {
-                process_incoming_request(&tmp);
-            }
-        }
-    }
+    // the others save their snapshots as well before the process goes
+    for (i = 1; i < num_workers; i++)
+        pthread_join(worker_tids[i], NULL);
+    return 0;
 }
 
 int load_nameservers(char *filename)
@@ -705,6 +3796,8 @@ int main(int argc, char **argv)
     int dochroot = 1;
     char resolvers[250] = {DEFAULT_RESOLVERS};
     char bind_ip[250] = {DEFAULT_BIND_IP};
+    char socks[250] = {DEFAULT_SOCKS};
+    char *socks_port;
     char chroot_dir[PATH_MAX] = {DEFAULT_CHROOT};
     char tsocks_conf[PATH_MAX];
     int log = 0;
@@ -715,9 +3808,169 @@ int main(int argc, char **argv)
     FILE *pf;
     int r;
     char *env_ptr;
+    const char *hosts_file = NULL, *zones_file = NULL, *block_file = NULL;
+    static const struct option long_opts[] = {
+        {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+        {"peers", required_argument, NULL, OPT_PEERS},
+        {"socks", required_argument, NULL, OPT_SOCKS},
+        {"max-requests", required_argument, NULL, OPT_MAX_REQUESTS},
+        {"load-factor", required_argument, NULL, OPT_LOAD_FACTOR},
+        {"udp-batch", required_argument, NULL, OPT_UDP_BATCH},
+        {"hedge-budget", required_argument, NULL, OPT_HEDGE_BUDGET},
+        {"tries", required_argument, NULL, OPT_TRIES},
+        {"tor-resolve", no_argument, NULL, OPT_TOR_RESOLVE},
+        {"min-warm", required_argument, NULL, OPT_MIN_WARM},
+        {"race", required_argument, NULL, OPT_RACE},
+        {"window", required_argument, NULL, OPT_WINDOW},
+        {"queue", required_argument, NULL, OPT_QUEUE},
+        {"shed", required_argument, NULL, OPT_SHED},
+        {"stale-window", required_argument, NULL, OPT_STALE_WINDOW},
+        {"stale-deadline", required_argument, NULL, OPT_STALE_DEADLINE},
+        {"refresh-ahead", required_argument, NULL, OPT_REFRESH_AHEAD},
+        {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+        {"hosts", required_argument, NULL, OPT_HOSTS},
+        {"local-zones", required_argument, NULL, OPT_LOCAL_ZONES},
+        {"blocklist", required_argument, NULL, OPT_BLOCKLIST},
+        {"block-answer", required_argument, NULL, OPT_BLOCK_ANSWER},
+        {"client-inflight", required_argument, NULL, OPT_CLIENT_INFLIGHT},
+        {"client-rate", required_argument, NULL, OPT_CLIENT_RATE},
+        {"tcp-clients", required_argument, NULL, OPT_TCP_CLIENTS},
+        {"tcp-pipeline", required_argument, NULL, OPT_TCP_PIPELINE},
+        {"tcp-idle", required_argument, NULL, OPT_TCP_IDLE},
+        {NULL, 0, NULL, 0}
+    };
 
-    while ((opt = getopt(argc, argv, "VlhdcC:b:f:p:P:")) != EOF) {
+    while ((opt = getopt_long(argc, argv, "VlhdcC:b:f:p:P:w:", long_opts, NULL)) != EOF) {
         switch (opt) {
+        // answer cache entries
+        case OPT_CACHE_SIZE:
+            cache_size = strtoul(optarg, NULL, 10);
+            break;
+        // parallel TCP connections
+        case OPT_PEERS:
+            num_peers = atoi(optarg);
+            if (num_peers < 1) num_peers = 1;
+            if (num_peers > MAX_PEERS) num_peers = MAX_PEERS;
+            break;
+        // SOCKS proxy
+        case OPT_SOCKS:
+            strncpy(socks, optarg, sizeof(socks)-1);
+            break;
+        // request table
+        case OPT_MAX_REQUESTS:
+            max_requests = atoi(optarg);
+            if (max_requests < 1) max_requests = DEFAULT_MAX_REQUESTS;
+            break;
+        case OPT_LOAD_FACTOR:
+            load_factor = atoi(optarg);
+            if (load_factor < 10 || load_factor > 90) load_factor = DEFAULT_LOAD_FACTOR;
+            break;
+        // datagrams per recvmmsg()/sendmmsg()
+        case OPT_UDP_BATCH:
+            udp_batch = atoi(optarg);
+            if (udp_batch < 1) udp_batch = 1;
+            if (udp_batch > MAX_UDP_BATCH) udp_batch = MAX_UDP_BATCH;
+            break;
+        // second copies of slow queries
+        case OPT_HEDGE_BUDGET:
+            hedge_budget = atoi(optarg);
+            if (hedge_budget < 0) hedge_budget = 0;
+            if (hedge_budget > 100) hedge_budget = 100;
+            break;
+        // upstream tries per request
+        case OPT_TRIES:
+            max_tries = atoi(optarg);
+            if (max_tries < 1) max_tries = 1;
+            if (max_tries > MAX_TRIES) max_tries = MAX_TRIES;
+            break;
+        case OPT_TOR_RESOLVE:
+            tor_resolve = 1;
+            break;
+        case OPT_MIN_WARM:
+            min_warm = atoi(optarg);
+            if (min_warm < 0) min_warm = 0;
+            if (min_warm > MAX_PEERS) min_warm = MAX_PEERS;
+            break;
+        case OPT_RACE:
+            race = atoi(optarg);
+            if (race < 1) race = 1;
+            if (race > MAX_PEERS) race = MAX_PEERS;
+            break;
+        case OPT_WINDOW:
+            window = atoi(optarg);
+            if (window < 1) window = 1;
+            if (window > PEER_IDS) window = PEER_IDS;
+            break;
+        case OPT_QUEUE:
+            queue_max = atoi(optarg);
+            if (queue_max < 0) queue_max = 0;
+            break;
+        case OPT_SHED:
+            if (strcmp(optarg, "servfail") == 0)
+                shed_rcode = DNS_RCODE_SERVFAIL;
+            else if (strcmp(optarg, "refused") == 0)
+                shed_rcode = DNS_RCODE_REFUSED;
+            else if (strcmp(optarg, "drop") == 0)
+                shed_rcode = -1;
+            else {
+                printf("unknown --shed policy %s, exit\n", optarg);
+                exit(1);
+            }
+            break;
+        case OPT_STALE_WINDOW:
+            stale_window = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STALE_DEADLINE:
+            stale_deadline = atoi(optarg);
+            if (stale_deadline < 0) stale_deadline = 0;
+            break;
+        case OPT_REFRESH_AHEAD:
+            refresh_ahead = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_SNAPSHOT:
+            snapshot_interval = atoi(optarg);
+            if (snapshot_interval < 0) snapshot_interval = 0;
+            break;
+        case OPT_CLIENT_INFLIGHT:
+            client_inflight = atoi(optarg);
+            if (client_inflight < 1) client_inflight = 1;
+            break;
+        case OPT_CLIENT_RATE:
+            client_rate = atoi(optarg);
+            if (client_rate < 0) client_rate = 0;
+            break;
+        // client connections to the TCP listener
+        case OPT_TCP_CLIENTS:
+            tcp_clients_max = atoi(optarg);
+            if (tcp_clients_max < 0) tcp_clients_max = 0;
+            break;
+        case OPT_TCP_PIPELINE:
+            tcp_pipeline = atoi(optarg);
+            if (tcp_pipeline < 1) tcp_pipeline = 1;
+            break;
+        case OPT_TCP_IDLE:
+            tcp_idle = atoi(optarg);
+            if (tcp_idle < 1) tcp_idle = 1;
+            break;
+        case OPT_HOSTS:
+            hosts_file = optarg;
+            break;
+        case OPT_LOCAL_ZONES:
+            zones_file = optarg;
+            break;
+        case OPT_BLOCKLIST:
+            block_file = optarg;
+            break;
+        case OPT_BLOCK_ANSWER:
+            if (strcmp(optarg, "nxdomain") == 0)
+                block_zero = 0;
+            else if (strcmp(optarg, "zero") == 0)
+                block_zero = 1;
+            else {
+                printf("unknown --block-answer %s, exit\n", optarg);
+                exit(1);
+            }
+            break;
         // log debug to file
         case 'l':
             log = 1;
@@ -739,6 +3992,12 @@ int main(int argc, char **argv)
             bind_port = atoi(optarg);
             if (bind_port < 1) bind_port = DEFAULT_BIND_PORT;
             break;
+        // worker threads
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1) num_workers = 1;
+            if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
+            break;
         // config file
         case 'f':
             strncpy(resolvers, optarg, sizeof(resolvers)-1);
@@ -766,6 +4025,18 @@ int main(int argc, char **argv)
 
     srand(time(NULL)); // This should use OpenSSL in the future
 
+    memset(&socks_addr, 0, sizeof(socks_addr));
+    socks_addr.sin_family = AF_INET;
+    socks_addr.sin_port = htons(DEFAULT_SOCKS_PORT);
+    if ((socks_port = strrchr(socks, ':')) != NULL) {
+        *socks_port++ = 0;
+        socks_addr.sin_port = htons(atoi(socks_port));
+    }
+    if (!inet_aton(socks, &socks_addr.sin_addr) || socks_addr.sin_port == 0) {
+        printf("is not a valid SOCKS proxy address: %s\n", socks);
+        exit(1);
+    }
+
     if (getuid() != 0 && (bind_port == DEFAULT_BIND_PORT || dochroot == 1)) {
         printf("ttdnsd must run as root to bind to port 53 and chroot(2)\n");
         exit(1);
@@ -863,6 +4134,12 @@ int main(int argc, char **argv)
         close(devnull);
     }
 
+    // the policy files are looked for in the chroot, where SIGHUP finds them too
+    if (!policy_init(hosts_file, zones_file, block_file)) {
+        printf("can't load the policy files, exit\n");
+        exit(1);
+    }
+
     printf("starting server...\n");
     r = server(bind_ip, bind_port);
     if (r != 0)
@@ -11,19 +11,126 @@
 
 #define DEBUG 0
 
-// number of parallel connected tcp peers
-#define MAX_PEERS 1
-// request timeout
-#define MAX_TIME 3 /* QUASIBUG 3 seconds is too short! */
-// number of trys per request (not used so far)
-#define MAX_TRY 1
+// maximal number of worker threads (event loops), see -w
+#define MAX_WORKERS 64
+#define DEFAULT_WORKERS 1
+// maximal number of parallel connected tcp peers
+#define MAX_PEERS 64
+// number of parallel tcp peers per worker, can be changed with --peers
+#define DEFAULT_PEERS 3
+// upstream ids per connection (0 isn't used)
+#define PEER_IDS 65535
+// bytes of queries buffered per connection until the socket takes them
+#define PEER_OBUF_SIZE 65536
+// initial and maximal size of a connection's receive buffer; the largest
+// DNS over TCP message is 65535 bytes plus the length prefix
+#define PEER_RBUF_SIZE 4096
+#define PEER_RBUF_MAX (2 + 65535)
+// how many queued requests a new connection is worth in peer_select()
+#define PEER_CONNECT_COST 4
+// queries in flight per connection at most, see --window
+#define DEFAULT_WINDOW 128
+// requests waiting for a window at most; udp_fd isn't read while it's full
+#define DEFAULT_QUEUE 256
+// requests a client address may have in the table at most, see --client-inflight
+#define DEFAULT_CLIENT_INFLIGHT 256
+// queries per second a client address may send upstream, 0 for no limit
+#define DEFAULT_CLIENT_RATE 0
+// client addresses hashed per worker, see client_get()
+#define CLIENT_BUCKETS 1024
+// top talkers shown in the statistics
+#define CLIENT_TOP 5
+// client connections per worker, see --tcp-clients; 0 disables TCP
+#define DEFAULT_TCP_CLIENTS 128
+// queries a client connection may have in flight, see --tcp-pipeline
+#define DEFAULT_TCP_PIPELINE 32
+// seconds a client connection may sit without queries or answers
+#define DEFAULT_TCP_IDLE 10
+// receive buffer of a client connection, room for a few of the largest
+// queries that fit a request_t
+#define TCP_CLIENT_RBUF (4 * RECV_BUF_SIZE)
+// answers buffered for a client that doesn't read them at most
+#define TCP_CLIENT_OBUF_MAX (4 * (2 + 65535))
+// connection attempts to different nameservers raced against each other
+// when requests wait for a connection, see --race
+#define DEFAULT_RACE 2
+// retransmission timeout of a try: srtt + 4 * rttvar of the nameserver
+// (RFC 6298) within these bounds, RTO_INITIAL_MS until it has answered,
+// doubled for every timeout since its last answer
+#define RTO_INITIAL_MS 3000
+#define RTO_MIN_MS 1000
+#define RTO_MAX_MS 10000
+// tries per request before answering SERVFAIL, can be changed with --tries
+#define DEFAULT_TRIES 2
+#define MAX_TRIES 8
+// give up on a SOCKS handshake after this many seconds
+#define SOCKS_TIMEOUT 30
+// close a connection after this many seconds without queries
+#define PEER_IDLE_TIMEOUT 120
+// connections kept open at least, see --min-warm; idle ones get a probe
+// query every PEER_KEEPALIVE seconds
+#define DEFAULT_MIN_WARM 0
+#define PEER_KEEPALIVE 20
+// seconds before a connection is replaced by one over a fresh circuit;
+// Tor takes no new streams on circuits dirty for 600 s (MaxCircuitDirtiness)
+#define PEER_ROTATE_AFTER 540
+#define TOR_CIRCUIT_DIRTINESS 600
+// seconds between looks at a busy connection due for rotation that has no
+// other one to take over, see peer_rotate()
+#define PEER_ROTATE_RETRY 5
+// SOCKS RESOLVE connections in flight per worker, see --tor-resolve
+#define MAX_RESOLVES 64
+// ms a RESOLVE may take before the query goes upstream the usual way
+#define RESOLVE_TIMEOUT_MS 5000
+// TTL of the answers built from RESOLVE replies, which don't carry one
+#define RESOLVE_TTL 60
+// seconds between housekeeping runs of the event loop
+#define HOUSEKEEPING_INTERVAL 1
+// percent of upstream queries that may be hedged, see --hedge-budget
+#define DEFAULT_HEDGE_BUDGET 5
+// unused hedge budget saved up for bursts, in hedges
+#define HEDGE_BURST 10
+// hedge delay bounds, and the delay used until there are enough samples
+#define HEDGE_MIN_MS 50
+#define HEDGE_DEFAULT_MS 1000
+// recent answer latencies the hedge delay (their 90th percentile) is taken from
+#define RTT_SAMPLES 128
+#define RTT_MIN_SAMPLES 16
+// epoll events handled per loop iteration
+#define MAX_EVENTS 64
 // maximal number of nameservers
 #define MAX_NAMESERVERS 32
-// request queue size (use a prime number for hashing)
-#define MAX_REQUESTS 499
-// 199, 1009
+// nameserver scoring: latency smoothing (1/8) and rate smoothing (1/16)
+#define NS_RTT_SHIFT 3
+#define NS_RATE_SHIFT 4
+// how much a 100% timeout or connection failure rate multiplies the latency
+#define NS_PENALTY 4
+// idle connections to a nameserver scoring this many times worse than the
+// best one are closed
+#define NS_ROTATE_FACTOR 2
+// seconds a failing nameserver is skipped, doubling per failure in a row
+#define NS_BACKOFF_MIN 2
+#define NS_BACKOFF_MAX 300
+// request table size, can be changed with --max-requests
+#define DEFAULT_MAX_REQUESTS 1024
+// how full the request id index may get in percent, see --load-factor
+#define DEFAULT_LOAD_FACTOR 50
 // max line size for configuration processing
 #define MAX_LINE_SIZE 1025
+// answer cache entries, can be changed with --cache-size
+#define DEFAULT_CACHE_SIZE 4096
+// seconds expired answers are kept to be served stale, see RFC 8767
+#define DEFAULT_STALE_WINDOW 86400
+// ms a client waits for the upstream before it gets a stale answer
+#define DEFAULT_STALE_DEADLINE 1800
+// TTL of stale answers, as RFC 8767 recommends
+#define STALE_TTL 30
+// seconds before expiry that answers asked for often are fetched again
+#define DEFAULT_REFRESH_AHEAD 10
+#define REFRESH_MIN_HITS 2
+// datagrams per recvmmsg()/sendmmsg() call, can be changed with --udp-batch
+#define DEFAULT_UDP_BATCH 32
+#define MAX_UDP_BATCH 1024
 
 // Magic numbers
 #define RECV_BUF_SIZE 1502
@@ -32,17 +139,28 @@
 #define NOGROUP 65534
 #define DEFAULT_BIND_PORT 53
 #define DEFAULT_BIND_IP "127.0.0.1"
+#define DEFAULT_SOCKS "127.0.0.1:9050"
+#define DEFAULT_SOCKS_PORT 9050
 #define DEFAULT_RESOLVERS "/etc/ttdnsd.conf"
 #define DEFAULT_LOG "ttdnsd.log"
+// cache snapshot of each worker, SNAPSHOT_DIR/DEFAULT_SNAPSHOT.<worker> - in
+// the chroot; the directory belongs to nobody, who renames new snapshots in
+#define SNAPSHOT_DIR "cache"
+#define DEFAULT_SNAPSHOT "ttdnsd.cache"
+// seconds between cache snapshots, can be changed with --snapshot
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+// TTL of answers from hosts entries and blocked names, see policy.c
+#define POLICY_TTL 60
 #define DEFAULT_CHROOT "/var/lib/ttdnsd"
 #define DEFAULT_TSOCKS_CONF "tsocks.conf"
 #define TSOCKS_CONF_ENV "TSOCKS_CONF_FILE"
 #define DEFAULT_PID_FILE DEFAULT_CHROOT"/ttdnsd.pid"
 
 #define HELP_STR ""\
-    "syntax: ttdnsd [bpfPCcdlhV]\n"\
+    "syntax: ttdnsd [bpwfPCcdlhV] [long options]\n"\
     "\t-b\t<local ip>\tlocal IP to bind to\n"\
     "\t-p\t<local port>\tbind to port\n"\
+    "\t-w\t<workers>\tworker threads, each with its own socket (default: 1)\n"\
     "\t-f\t<resolvers>\tfilename to read resolver IP(s) from\n"\
     "\t-P\t<PID file>\tfile to store process ID - pre-chroot\n"\
     "\t-C\t<chroot dir>\tchroot(2) to <chroot dir>\n"\
@@ -50,53 +168,337 @@
     "\t-d\t\t\tDEBUG (don't fork and print debug)\n"\
     "\t-l\t\t\twrite debug log to: " DEFAULT_LOG "\n"\
     "\t-h\t\t\tprint this helpful text and exit\n"\
-    "\t-V\t\t\tprint version and exit\n\n"\
+    "\t-V\t\t\tprint version and exit\n"\
+    "\t--cache-size\t<entries>\tanswers to cache, 0 disables (default: 4096)\n"\
+    "\t--stale-window\t<s>\tserve answers up to s seconds past their TTL, 0 disables (default: 86400)\n"\
+    "\t--stale-deadline\t<ms>\twait that long for the upstream before serving stale (default: 1800)\n"\
+    "\t--refresh-ahead\t<s>\trefetch popular answers s seconds before they expire, 0 disables (default: 10)\n"\
+    "\t--snapshot\t<s>\tsave the cache to " SNAPSHOT_DIR "/" DEFAULT_SNAPSHOT ".<worker> every s seconds and on exit, 0 disables (default: 300)\n"\
+    "\t--hosts\t\t<file>\tanswer the names in this hosts file with their address - in the chroot\n"\
+    "\t--local-zones\t<file>\tanswer names under these domains locally, NXDOMAIN if not in --hosts\n"\
+    "\t--blocklist\t<file>\tblock these domains and the names under them\n"\
+    "\t--block-answer\t<answer>\tanswer blocked names with nxdomain or zero, 0.0.0.0 (default: nxdomain)\n"\
+    "\t--peers\t\t<n>\tparallel TCP connections per worker (default: 3)\n"\
+    "\t--socks\t\t<ip:port>\tSOCKS proxy to use (default: " DEFAULT_SOCKS ")\n"\
+    "\t--max-requests\t<n>\trequests in flight at most (default: 1024)\n"\
+    "\t--load-factor\t<percent>\tmaximal fill of the request index (default: 50)\n"\
+    "\t--udp-batch\t<n>\tdatagrams per recvmmsg/sendmmsg call (default: 32)\n"\
+    "\t--hedge-budget\t<percent>\tqueries that may be sent twice, 0 disables (default: 5)\n"\
+    "\t--tries\t\t<n>\tupstream tries before answering SERVFAIL (default: 2)\n"\
+    "\t--tor-resolve\t\tanswer A and PTR queries with Tor's SOCKS RESOLVE\n"\
+    "\t--min-warm\t<n>\tconnections per worker kept open and alive (default: 0)\n"\
+    "\t--race\t\t<n>\tnameservers raced for a needed connection, 1 disables (default: 2)\n"\
+    "\t--window\t<n>\tqueries in flight per connection (default: 128)\n"\
+    "\t--queue\t\t<n>\tqueries waiting for a window before shedding (default: 256)\n"\
+    "\t--shed\t\t<policy>\tanswer shed queries with servfail, refused or drop them (default: servfail)\n"\
+    "\t--client-inflight\t<n>\tqueries in flight per client address (default: 256)\n"\
+    "\t--client-rate\t<n>\tqueries per second per client address, 0 for no limit (default: 0)\n"\
+    "\t--tcp-clients\t<n>\tTCP client connections per worker, 0 disables TCP (default: 128)\n"\
+    "\t--tcp-pipeline\t<n>\tqueries in flight per TCP client connection (default: 32)\n"\
+    "\t--tcp-idle\t<s>\tclose TCP client connections idle for s seconds (default: 10)\n\n"\
     "export TSOCKS_CONF_FILE to point to config file inside the chroot\n"\
+    "send SIGUSR1 to print statistics\n"\
     "\n"
 
+/* getopt_long() values of the options without a short form */
+enum {
+    OPT_CACHE_SIZE = 256,
+    OPT_PEERS,
+    OPT_SOCKS,
+    OPT_MAX_REQUESTS,
+    OPT_LOAD_FACTOR,
+    OPT_UDP_BATCH,
+    OPT_HEDGE_BUDGET,
+    OPT_TRIES,
+    OPT_TOR_RESOLVE,
+    OPT_MIN_WARM,
+    OPT_RACE,
+    OPT_WINDOW,
+    OPT_QUEUE,
+    OPT_SHED,
+    OPT_STALE_WINDOW,
+    OPT_STALE_DEADLINE,
+    OPT_REFRESH_AHEAD,
+    OPT_SNAPSHOT,
+    OPT_HOSTS,
+    OPT_LOCAL_ZONES,
+    OPT_BLOCKLIST,
+    OPT_BLOCK_ANSWER,
+    OPT_CLIENT_INFLIGHT,
+    OPT_CLIENT_RATE,
+    OPT_TCP_CLIENTS,
+    OPT_TCP_PIPELINE,
+    OPT_TCP_IDLE
+};
+
 typedef enum {
     DEAD = 0,
-    CONNECTING,
-    CONNECTING2,
+    CONNECTING, /**< TCP connect to the SOCKS proxy in progress */
+    SOCKS_METHOD, /**< greeting sent, waiting for the method selection */
+    SOCKS_AUTH, /**< username/password sent, waiting for the verdict */
+    SOCKS_REPLY, /**< CONNECT sent, waiting for the proxy's reply */
     CONNECTED
 } CON_STATE;
 
+/* What the data.ptr of an epoll event points at; a peer_t starts with one */
+typedef enum {
+    EV_UDP = 0,
+    EV_PEER,
+    EV_RESOLVE, /**< a resolve_t starts with one */
+    EV_TCP_LISTEN,
+    EV_TCP_CLIENT /**< a tcp_client_t starts with one */
+} EV_TYPE;
+
 typedef enum {
-    WAITING = 0,
-    SENT
+    UNUSED = 0,
+    WAITING,
+    SENT,
+    COALESCED, /**< answered along with an identical request in flight */
+    RESOLVING, /**< asked of the SOCKS proxy, see resolve_start() */
+    QUEUED /**< waiting for room on a connection, see admission_drain() */
 } REQ_STATE;
 
+typedef enum {
+    POLICY_PASS = 0, /**< goes upstream */
+    POLICY_ADDR, /**< a hosts entry */
+    POLICY_NODATA, /**< a local zone's own name */
+    POLICY_NXDOMAIN, /**< under a local zone */
+    POLICY_BLOCKED /**< on the blocklist, see --block-answer */
+} POLICY_ACTION;
+
+// DNS wire format bits we need to look at
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_NAME 255
+#define DNS_MAX_MSG 65535
+// largest answer over UDP to a query without EDNS
+#define DNS_UDP_SIZE 512
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_PTR 12
+#define DNS_TYPE_OPT 41
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED 5
+
+/* Lookup key of a question: lower-cased wire name, qtype, qclass, DO bit */
+struct dns_key_t {
+    unsigned char k[DNS_MAX_NAME + 5];
+    int kl; /**< bytes used in k */
+};
+
+/* A deadline on the timer wheel of a worker, see timer.c */
+struct timeout_t {
+    struct timeout_t *prev, *next; /**< wheel slot links, NULL when not set */
+    unsigned long long expire; /**< ms, see now_ms() */
+    void (*fn)(void *arg); /**< called once expire has passed */
+    void *arg;
+};
+
+struct request_t;
+
+/* An earlier try of a request, whose answer is still taken, see request_move() */
+struct request_try_t {
+    struct peer_t *peer;
+    uint id; /**< upstream id on that peer */
+    unsigned long long sent_ms;
+};
+
+/* Intrusive FIFO of requests, linked through request_t.prev/next */
+struct request_list_t {
+    struct request_t *head;
+    struct request_t *tail;
+    int len;
+};
+
 struct request_t {
     struct sockaddr_in a; /* client’s IP/port */
     socklen_t al;
     unsigned char b[1502]; /**< request buffer */
     int bl; /**< bytes in request buffer */
-    uint id; /**< dns request id */
+    uint id; /**< dns request id on the peer's connection */
     int rid; /**< real dns request id */
-    REQ_STATE active; /**< 1=sent, 0=waiting for tcp to become connected */
-    time_t timeout; /**< timeout of request */
+    REQ_STATE active; /**< sent, waiting for tcp to become connected or unused */
+    struct timeout_t deadline; /**< end of the current try, see request_timed_out() */
+    int tries; /**< peers the request was queued on so far */
+    struct request_try_t earlier[MAX_TRIES]; /**< tries sent before the current one */
+    int num_earlier; /**< entries in earlier */
+    struct peer_t *peer; /**< peer the request is queued on or sent to */
+    struct request_list_t *list; /**< list the request is on, if any */
+    struct request_t *prev, *next; /**< links in that list */
+    struct dns_key_t key; /**< question key, see dns_question_key() */
+    int qend; /**< end of the question in b + 2, -1 if it can't be keyed */
+    unsigned int qhash; /**< dns_key_hash() of key */
+    struct request_t *qnext; /**< question index chain, or next waiter */
+    struct request_t *waiters; /**< COALESCED requests waiting on this one */
+    unsigned long long start_ms; /**< when the request came in, see now_ms() */
+    unsigned long long sent_ms; /**< when it was last sent upstream */
+    struct request_t *twin; /**< the other copy of a hedged request */
+    int hedge; /**< this is the copy sent by hedging */
+    struct timeout_t hedge_at; /**< when to send a copy, see request_hedge_due() */
+    int probe; /**< keepalive query of its peer without a client, see peer_probe() */
+    int answered; /**< the client got a stale answer or there's none, see request_prefetch() */
+    struct client_t *client; /**< charged for it, NULL for hedge copies and probes */
+    struct timeout_t stale_at; /**< when to serve stale, see request_stale_due() */
+    struct tcp_client_t *tcp; /**< connection the query came over, NULL for UDP */
+};
+
+/* What a client address has in the table and may send, see client_get() */
+struct client_t {
+    struct in_addr addr;
+    int used; /**< in the hash, not on the free list */
+    struct client_t *hnext; /**< hash chain or free list */
+    struct client_t *prev, *next; /**< idle list, or the admission round while it has requests queued */
+    int inflight; /**< requests in the table */
+    unsigned long long tokens; /**< thousandths of queries it may send, see --client-rate */
+    unsigned long long refilled; /**< ms of the last refill */
+    struct request_list_t queued; /**< its requests in the admission queue */
+    unsigned long requests, throttled; /**< totals */
+};
+
+/* A client connection to the TCP listener, carrying length-prefixed
+   queries and answers in whatever order they're ready, see tcp_accept() */
+struct tcp_client_t {
+    EV_TYPE ev; /**< must come first, see EV_TYPE */
+    int fd; /**< -1 once closed while requests of it are still in flight */
+    struct sockaddr_in a;
+    int inflight; /**< requests in the table, see --tcp-pipeline */
+    int paused; /**< queries left unread until some are answered */
+    int eof; /**< the client is done sending, close once it's answered */
+    int resume; /**< on the list of connections to read again */
+    int held; /**< left unread while the admission queue is full */
+    struct tcp_client_t *hnext; /**< list of the held ones, see tcp_client_hold() */
+    struct timeout_t timer; /**< idle deadline, see --tcp-idle */
+    unsigned char b[TCP_CLIENT_RBUF]; /**< receive buffer */
+    int bl; /**< bytes in b */
+    unsigned char *ob; /**< answers the socket didn't take yet */
+    int ob_pos; /**< first byte to write in ob */
+    int ob_len; /**< end of the data in ob */
+    int ob_size; /**< size of ob, up to TCP_CLIENT_OBUF_MAX */
+    struct tcp_client_t *next; /**< free list or resume list */
 };
 
 struct peer_t
 {
+    EV_TYPE ev; /**< must come first, see EV_TYPE */
     struct sockaddr_in tcp;
+    struct in_addr ns; /**< nameserver this connection goes to */
+    int nsi; /**< its number in the nameservers pool */
     int tcp_fd;
-    time_t timeout;
-    CON_STATE con; /**< connection state 0=dead, 1=connecting..., 3=connected */
-    unsigned char b[RECV_BUF_SIZE]; /**< receive buffer */
-    int bl; /**< bytes in receive buffer */ // bl? Why don't we call this bytes_in_recv_buf or something meaningful?
+    struct timeout_t timer; /**< end of the SOCKS handshake or of idling */
+    struct timeout_t rotate; /**< when the connection gets replaced, see peer_rotate() */
+    unsigned long long connected_ms; /**< when the SOCKS handshake finished */
+    int draining; /**< takes no new requests and closes once they're answered */
+    unsigned int race; /**< connection attempts racing each other share it, see peer_race() */
+    CON_STATE con; /**< connection state, see CON_STATE */
+    unsigned int generation; /**< connections made so far, for SOCKS isolation */
+    unsigned char *b; /**< receive buffer, grows up to PEER_RBUF_MAX */
+    int bsize; /**< size of b */
+    int rpos; /**< read cursor: first byte not parsed yet */
+    int bl; /**< end of the data in the receive buffer */
+    struct request_list_t pending; /**< requests waiting for this connection */
+    struct request_list_t sent; /**< requests waiting for an answer */
+    unsigned short *id_free; /**< ring of free upstream ids */
+    unsigned int id_head; /**< next id to hand out in id_free */
+    unsigned int id_count; /**< free ids in the ring */
+    struct request_t **inflight; /**< upstream id -> request */
+    unsigned char *ob; /**< output ring of PEER_OBUF_SIZE bytes */
+    unsigned int ob_head; /**< first byte to write in ob */
+    unsigned int ob_len; /**< bytes waiting in ob */
+    int dirty; /**< on the list of peers to flush */
+    unsigned long answered; /**< answers received over this peer */
+};
+
+/* A question put to the SOCKS proxy itself with Tor's RESOLVE extension,
+   over a short-lived connection of its own, see resolve_start() */
+struct resolve_t {
+    EV_TYPE ev; /**< must come first, see EV_TYPE */
+    int fd;
+    CON_STATE con; /**< handshake state, SOCKS_REPLY waits for the answer */
+    struct request_t *r; /**< the request, NULL while the slot is free */
+    int type; /**< DNS_TYPE_A or DNS_TYPE_PTR */
+    char name[DNS_MAX_NAME + 1]; /**< the name an A question asks for */
+    struct in_addr addr; /**< the address a PTR question asks for */
+    struct timeout_t timer; /**< see RESOLVE_TIMEOUT_MS */
+    unsigned char b[4 + 1 + 255 + 2]; /**< the proxy's replies */
+    int bl; /**< bytes in b */
+    struct resolve_t *next; /**< free list */
 };
 
+/* What a worker has seen of a nameserver, see ns_select() */
+struct ns_stats_t {
+    unsigned int srtt; /**< smoothed answer latency in ms, 0 until the first answer */
+    unsigned int rttvar; /**< its smoothed variation */
+    unsigned int rto_backoff; /**< timeouts since the last answer, see ns_rto() */
+    unsigned int timeout_rate; /**< per mille of queries timing out, smoothed */
+    unsigned int fail_rate; /**< per mille of connections failing, smoothed */
+    unsigned int fails; /**< connection failures in a row */
+    time_t backoff_until; /**< skipped until then, unless all of them are */
+    unsigned long answers, timeouts, connects, failures; /**< totals */
+};
 
-int request_find(uint id);
-int peer_connect(struct peer_t *p, struct in_addr ns);
+struct cache_entry_t {
+    struct cache_entry_t *hnext; /**< hash chain */
+    struct cache_entry_t *prev, *next; /**< LRU list */
+    unsigned int hash;
+    struct dns_key_t key;
+    time_t stored; /**< when the answer came in */
+    time_t expire; /**< stored + minimum TTL of the answer */
+    unsigned int hits; /**< lookups that found it live, see --refresh-ahead */
+    int bl; /**< bytes in b */
+    unsigned char b[]; /**< the answer as received, without length prefix */
+};
+
+
+struct request_t *request_find(const struct sockaddr_in *a, uint rid);
+int peer_connect(struct peer_t *p, int nsi);
 int peer_connected(struct peer_t *p);
+int peer_handshake(struct peer_t *p);
 int peer_sendreq(struct peer_t *p, struct request_t *r);
 int peer_readres(struct peer_t *p);
 void peer_handleoutstanding(struct peer_t *p);
 struct peer_t *peer_select(void);
-struct in_addr ns_select(void);
+int ns_select(void);
 int request_add(struct request_t *r);
 int server(char *bind_ip, int bind_port);
 int load_nameservers(char *filename);
 
+int dns_skip_name(const unsigned char *m, int len, int off);
+int dns_question_key(const unsigned char *m, int len, struct dns_key_t *k);
+unsigned int dns_key_hash(const struct dns_key_t *k);
+int dns_error_reply(const unsigned char *q, int len, int rcode, unsigned char *out);
+int dns_udp_size(const unsigned char *q, int len);
+int dns_truncate(unsigned char *m, int len);
+int dns_resolve_question(const struct dns_key_t *k, char *name, struct in_addr *addr);
+int dns_name_encode(const char *name, int len, unsigned char *out);
+int dns_answer_reply(const unsigned char *q, int qend, int type, unsigned int ttl,
+                     const unsigned char *rd, int rdlen, unsigned char *out);
+unsigned int dns_min_ttl(unsigned char *m, int len);
+void dns_age_ttls(unsigned char *m, int len, unsigned int age);
+void dns_set_ttls(unsigned char *m, int len, unsigned int ttl);
+
+int cache_init(unsigned int size, unsigned int stale);
+struct cache_entry_t *cache_lookup(const struct dns_key_t *k, time_t now);
+struct cache_entry_t *cache_lookup_stale(const struct dns_key_t *k, time_t now);
+void cache_store(const struct dns_key_t *k, const unsigned char *m, int len,
+                 unsigned int ttl, time_t now);
+int cache_dump(time_t now, unsigned char **out, size_t *len);
+int cache_write(const char *path, const unsigned char *buf, size_t len);
+int cache_load(int fd, time_t now);
+void cache_stats(void);
+
+int policy_init(const char *hosts, const char *zones, const char *blocklist);
+int policy_start(void);
+void policy_refresh(int worker);
+POLICY_ACTION policy_lookup(const struct dns_key_t *k, struct in_addr *addr);
+
+unsigned long long now_ms(void);
+void timeouts_init(unsigned long long now);
+void timeout_init(struct timeout_t *t, void (*fn)(void *arg), void *arg);
+int timeout_pending(const struct timeout_t *t);
+void timeout_set(struct timeout_t *t, unsigned long long expire);
+void timeout_cancel(struct timeout_t *t);
+void timeouts_run(unsigned long long now);
+int timeouts_next(unsigned long long now);
+